@@ -0,0 +1 @@
+cmd_nhrp/opennhrp := gcc -g   -o nhrp/opennhrp nhrp/libev.o nhrp/opennhrp.o nhrp/nhrp_address.o nhrp/nhrp_packet.o nhrp/nhrp_peer.o nhrp/nhrp_trie.o nhrp/nhrp_hash.o nhrp/nhrp_server.o nhrp/nhrp_interface.o nhrp/nhrp_script.o nhrp/nhrp_wheel.o nhrp/admin.o nhrp/sysdep_netlink.o nhrp/sysdep_pfpacket.o nhrp/sysdep_ring.o nhrp/sysdep_syslog.o  -lm -lcares 
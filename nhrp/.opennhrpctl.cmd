@@ -0,0 +1 @@
+cmd_nhrp/opennhrpctl := gcc -g   -o nhrp/opennhrpctl nhrp/opennhrpctl.o  
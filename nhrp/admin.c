@@ -21,6 +21,7 @@
 #include "nhrp_peer.h"
 #include "nhrp_address.h"
 #include "nhrp_interface.h"
+#include "nhrp_script.h"
 
 static struct ev_io accept_io;
 
@@ -84,7 +85,7 @@ static void admin_free_remote(struct admin_remote *rm)
 
 static int admin_show_peer(void *ctx, struct nhrp_peer *peer)
 {
-	char buf[512], tmp[32];
+	char buf[768], tmp[32];
 	char *str;
 	size_t len = sizeof(buf);
 	int i = 0, rel;
@@ -119,13 +120,13 @@ static int admin_show_peer(void *ctx, struct nhrp_peer *peer)
 			nhrp_address_format(&peer->next_hop_address,
 					    sizeof(tmp), tmp));
 	}
-	if (peer->nbma_hostname) {
+	if (nhrp_peer_hostname(peer) != NULL) {
 		i += snprintf(&buf[i], len - i, "Hostname: %s\n",
-			      peer->nbma_hostname);
+			      nhrp_peer_hostname(peer));
 	}
-	if (peer->next_hop_nat_oa.type != PF_UNSPEC) {
+	if (nhrp_peer_nat_oa(peer) != NULL) {
 		i += snprintf(&buf[i], len - i, "NBMA-NAT-OA-Address: %s\n",
-			nhrp_address_format(&peer->next_hop_nat_oa,
+			nhrp_address_format(nhrp_peer_nat_oa(peer),
 					    sizeof(tmp), tmp));
 	}
 	if (peer->flags & (NHRP_PEER_FLAG_USED | NHRP_PEER_FLAG_UNIQUE |
@@ -142,6 +143,12 @@ static int admin_show_peer(void *ctx, struct nhrp_peer *peer)
 			i += snprintf(&buf[i], len - i, " lower-up");
 		i += snprintf(&buf[i], len - i, "\n");
 	}
+	if (peer->cold != NULL && peer->cold->srtt != 0) {
+		i += snprintf(&buf[i], len - i,
+			      "Round-Trip-Time: %.3f\n"
+			      "Round-Trip-Variation: %.3f\n",
+			      peer->cold->srtt, peer->cold->rttvar);
+	}
 	if (peer->expire_time) {
 		rel = (int) (peer->expire_time - ev_now());
 		if (rel >= 0) {
@@ -345,7 +352,7 @@ static void admin_cache_flush(void *ctx, const char *cmd)
 
 static int admin_show_interface(void *ctx, struct nhrp_interface *iface)
 {
-	char buf[512], tmp[32];
+	char buf[1024], tmp[32];
 	size_t len = sizeof(buf);
 	int i = 0;
 
@@ -364,11 +371,12 @@ static int admin_show_interface(void *ctx, struct nhrp_interface *iface)
 
 	if (iface->flags) {
 		i += snprintf(&buf[i], len - i,
-			"Flags:%s%s%s%s%s\n",
+			"Flags:%s%s%s%s%s%s\n",
 			(iface->flags & NHRP_INTERFACE_FLAG_NON_CACHING) ? " non-caching" : "",
 			(iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT) ? " shortcut" : "",
 			(iface->flags & NHRP_INTERFACE_FLAG_REDIRECT) ? " redirect" : "",
 			(iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT_DEST) ? " shortcut-dest" : "",
+			(iface->flags & NHRP_INTERFACE_FLAG_MCAST_OFFLOAD) ? " multicast-offload" : "",
 			(iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED) ? " configured" : "");
 	}
 
@@ -377,10 +385,12 @@ static int admin_show_interface(void *ctx, struct nhrp_interface *iface)
 
 	i += snprintf(&buf[i], len - i,
 		"Holding-Time: %u\n"
+		"Renew-Jitter: %u%%\n"
 		"Route-Table: %u\n"
 		"GRE-Key: %u\n"
 		"MTU: %u\n",
 		iface->holding_time,
+		iface->renew_jitter,
 		iface->route_table,
 		iface->gre_key,
 		iface->mtu);
@@ -406,6 +416,30 @@ static int admin_show_interface(void *ctx, struct nhrp_interface *iface)
 			"NBMA-NAT-OA: %s\n",
 			nhrp_address_format(&iface->nat_cie.nbma_address, sizeof(tmp), tmp));
 	}
+	if (iface->nbma_hash.size != 0) {
+		i += snprintf(&buf[i], len - i,
+			"NBMA-Hash-Entries: %u\n"
+			"NBMA-Hash-Buckets: %u\n"
+			"NBMA-Hash-Load: %.2f\n"
+			"NBMA-Hash-Max-Chain: %u\n",
+			iface->nbma_hash.count,
+			iface->nbma_hash.size,
+			(double) iface->nbma_hash.count / iface->nbma_hash.size,
+			nhrp_hash_max_chain(&iface->nbma_hash));
+	}
+	if (iface->mcast_mask || iface->mcast_numaddr) {
+		i += snprintf(&buf[i], len - i,
+			"Multicast-Sent: %lu\n"
+			"Multicast-Send-Errors: %lu\n",
+			iface->mcast_tx_packets,
+			iface->mcast_tx_errors);
+	}
+	i += snprintf(&buf[i], len - i,
+		"Peer-Entries: %u\n"
+		"Peer-Memory: %zu\n",
+		iface->peer_count,
+		iface->peer_count * nhrp_peer_object_size() +
+		iface->peer_cold_count * sizeof(struct nhrp_peer_cold));
 done:
 	i += snprintf(&buf[i], len - i, "\n");
 	admin_raw_write(ctx, buf, i);
@@ -445,6 +479,103 @@ static void admin_redirect_purge(void *ctx, const char *cmd)
 		    count);
 }
 
+static void admin_stats_show(void *ctx, const char *cmd)
+{
+	struct nhrp_pool *pool;
+	int i;
+
+	forward_update_stats();
+	admin_write(ctx,
+		    "Status: ok\n\n"
+		    "Route-Cache-Hits: %lu\n"
+		    "Route-Cache-Misses: %lu\n"
+		    "Peer-Slabs: %lu\n"
+		    "Peer-Slab-Bytes: %lu\n"
+		    "Multicast-Queued: %lu\n"
+		    "Multicast-Queue-Drops: %lu\n"
+		    "Multicast-Kernel-Drops: %lu\n"
+		    "Multicast-Replicated: %lu\n"
+		    "Multicast-Replication-Rate: %.0f\n"
+		    "Neighbor-Updates: %lu\n"
+		    "Neighbor-Updates-Coalesced: %lu\n"
+		    "Netlink-Batches: %lu\n"
+		    "Kernel-Route-Cache-Hits: %lu\n"
+		    "Kernel-Route-Cache-Misses: %lu\n"
+		    "Kernel-Route-Cache-Flushes: %lu\n"
+		    "Netlink-Overruns: %lu\n"
+		    "Netlink-Resyncs: %lu\n"
+		    "Netlink-Routes-Filtered: %lu\n",
+		    nhrp_peer_stats.route_cache_hits,
+		    nhrp_peer_stats.route_cache_misses,
+		    nhrp_peer_stats.peer_slabs,
+		    nhrp_peer_stats.peer_slab_bytes,
+		    forward_stats.mcast_queued,
+		    forward_stats.mcast_queue_drops,
+		    forward_stats.mcast_kernel_drops,
+		    forward_stats.mcast_replicated,
+		    forward_stats.mcast_rate,
+		    kernel_stats.neigh_updates,
+		    kernel_stats.neigh_coalesced,
+		    kernel_stats.netlink_batches,
+		    kernel_stats.route_cache_hits,
+		    kernel_stats.route_cache_misses,
+		    kernel_stats.route_cache_flushes,
+		    kernel_stats.netlink_overruns,
+		    kernel_stats.netlink_resyncs,
+		    kernel_stats.routes_filtered);
+
+	admin_write(ctx,
+		    "Scripts-Started: %lu\n"
+		    "Scripts-Running: %lu\n"
+		    "Script-Queue-Depth: %lu\n"
+		    "Script-Queue-Peak: %lu\n"
+		    "Script-Queue-Wait-Avg: %.3f\n"
+		    "Script-Queue-Wait-Max: %.3f\n",
+		    nhrp_script_stats.started,
+		    nhrp_script_stats.running,
+		    nhrp_script_stats.queued,
+		    nhrp_script_stats.queue_peak,
+		    nhrp_script_stats.started ?
+			nhrp_script_stats.wait_total /
+			nhrp_script_stats.started : 0.0,
+		    nhrp_script_stats.wait_max);
+
+	admin_write(ctx,
+		    "Requests-Pending: %lu\n"
+		    "Requests-Sent: %lu\n"
+		    "Requests-Timed-Out: %lu\n"
+		    "Replies-Matched: %lu\n"
+		    "Replies-Unmatched: %lu\n"
+		    "Reply-Latency-Avg: %.3f\n"
+		    "Reply-Latency-Max: %.3f\n",
+		    nhrp_request_stats.pending,
+		    nhrp_request_stats.sent,
+		    nhrp_request_stats.timeouts,
+		    nhrp_request_stats.matched,
+		    nhrp_request_stats.unmatched,
+		    nhrp_request_stats.matched ?
+			nhrp_request_stats.latency_total /
+			nhrp_request_stats.matched : 0.0,
+		    nhrp_request_stats.latency_max);
+
+	admin_write(ctx,
+		    "Registrations-Admitted: %lu\n"
+		    "Registrations-Deferred: %lu\n",
+		    server_stats.registrations_admitted,
+		    server_stats.registrations_deferred);
+
+	for (i = 0; i < NHRP_NUM_POOLS; i++) {
+		pool = &nhrp_packet_pools[i];
+		admin_write(ctx,
+			    "%s-Pool-Used: %u\n"
+			    "%s-Pool-Free: %u\n"
+			    "%s-Pool-Peak: %u\n",
+			    pool->name, pool->used,
+			    pool->name, pool->free,
+			    pool->name, pool->peak);
+	}
+}
+
 struct update_nbma {
 	struct nhrp_address addr;
 	int count;
@@ -509,6 +640,7 @@ static struct {
 	{ "cache lowerdown",	admin_cache_lower_down },
 	{ "interface show",	admin_interface_show },
 	{ "redirect purge",	admin_redirect_purge },
+	{ "stats show",		admin_stats_show },
 	{ "update nbma",	admin_update_nbma },
 };
 
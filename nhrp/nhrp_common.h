@@ -13,9 +13,10 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <linux/if_ether.h>
+#include "nhrp_address.h"
 
 struct nhrp_interface;
-struct nhrp_address;
+struct nhrp_peer;
 
 extern const char *nhrp_config_file, *nhrp_script_file;
 extern int nhrp_running, nhrp_verbose;
@@ -49,9 +50,55 @@ void nhrp_hex_dump(const char *name, const uint8_t *buf, int bytes);
 }
 
 /* Initializers for system dependant stuff */
+struct forward_stats {
+	unsigned long mcast_queued;
+	unsigned long mcast_queue_drops;
+	unsigned long mcast_kernel_drops;
+	unsigned long mcast_replicated;
+	double mcast_rate;
+};
+
+extern int forward_queue_len;
+extern struct forward_stats forward_stats;
+
 int forward_init(void);
 void forward_cleanup(void);
-int forward_local_addresses_changed(void);
+void forward_local_address_add(struct nhrp_peer *peer);
+void forward_local_address_del(struct nhrp_peer *peer);
+void forward_update_stats(void);
+
+struct kernel_stats {
+	unsigned long neigh_updates;
+	unsigned long neigh_coalesced;
+	unsigned long netlink_batches;
+	unsigned long route_cache_hits;
+	unsigned long route_cache_misses;
+	unsigned long route_cache_flushes;
+	unsigned long netlink_overruns;
+	unsigned long netlink_resyncs;
+	unsigned long routes_filtered;
+};
+
+struct kernel_route_query;
+
+typedef void (*kernel_route_callback)(struct kernel_route_query *query,
+				      int ok);
+
+/* On success the source is filled in if it was unspecified, and
+ * next_hop and mtu are set as with kernel_route(). */
+struct kernel_route_query {
+	kernel_route_callback callback;
+	struct list_head pending_entry;
+	uint32_t seq;
+	int oif;
+	struct nhrp_address dest;
+	struct nhrp_address source;
+	struct nhrp_address next_hop;
+	uint16_t mtu;
+};
+
+extern int kernel_rx_budget, kernel_rx_ring_blocks, kernel_netlink_buffer;
+extern struct kernel_stats kernel_stats;
 
 int kernel_init(void);
 void kernel_stop_listening(void);
@@ -61,11 +108,30 @@ int kernel_route(struct nhrp_interface *out_iface,
 		 struct nhrp_address *default_source,
 		 struct nhrp_address *next_hop,
 		 uint16_t *mtu);
+int kernel_route_query(struct kernel_route_query *query,
+		       struct nhrp_interface *out_iface,
+		       struct nhrp_address *dest,
+		       struct nhrp_address *default_source,
+		       kernel_route_callback callback);
+void kernel_route_cancel(struct kernel_route_query *query);
 int kernel_send(uint8_t *packet, size_t bytes, struct nhrp_interface *out,
 		struct nhrp_address *to);
 int kernel_inject_neighbor(struct nhrp_address *neighbor,
 			   struct nhrp_address *hwaddr,
 			   struct nhrp_interface *dev);
+int kernel_route_update(int add, struct nhrp_interface *dev,
+			struct nhrp_address *dest, int prefix_len,
+			struct nhrp_address *next_hop);
+int kernel_nbma_route_update(int add, struct nhrp_address *dest,
+			     struct nhrp_address *source, uint16_t mtu);
+
+struct server_stats {
+	unsigned long registrations_admitted;
+	unsigned long registrations_deferred;
+};
+
+extern int server_registration_rate;
+extern struct server_stats server_stats;
 
 int log_init(void);
 int admin_init(const char *socket);
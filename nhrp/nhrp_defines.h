@@ -79,5 +79,6 @@
 #endif
 
 #define NHRP_DEFAULT_HOLDING_TIME	(2 * 60 * 60)
+#define NHRP_DEFAULT_RENEW_JITTER	10
 
 #endif
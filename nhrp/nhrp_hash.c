@@ -0,0 +1,197 @@
+/* nhrp_hash.c - Resizable hash table of intrusive nodes
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nhrp_hash.h"
+
+#define NHRP_HASH_MIN_SIZE		16
+#define NHRP_HASH_MIGRATE_STEP		4
+
+uint32_t nhrp_hash_seed;
+static struct hlist_head empty_bucket;
+
+void nhrp_hash_init(void)
+{
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &nhrp_hash_seed, sizeof(nhrp_hash_seed)) ==
+		    sizeof(nhrp_hash_seed)) {
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+	nhrp_hash_seed = random();
+}
+
+static inline uint32_t rol32(uint32_t word, int shift)
+{
+	return (word << shift) | (word >> (32 - shift));
+}
+
+/* MurmurHash3 (x86, 32-bit) */
+uint32_t nhrp_hash_bytes(const uint8_t *data, int len, uint32_t initval)
+{
+	uint32_t h = initval, k;
+	int i;
+
+	for (i = 0; i < len; i += 4) {
+		k = 0;
+		memcpy(&k, &data[i], len - i < 4 ? len - i : 4);
+		k *= 0xcc9e2d51;
+		k = rol32(k, 15);
+		k *= 0x1b873593;
+		h ^= k;
+		h = rol32(h, 13);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	h ^= len;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static void nhrp_hash_migrate_bucket(struct nhrp_hash *table,
+				     struct hlist_head *bucket)
+{
+	struct nhrp_hash_node *n;
+	struct hlist_node *pos, *next;
+
+	hlist_for_each_entry_safe(n, pos, next, bucket, list) {
+		hlist_del(&n->list);
+		hlist_add_head(&n->list, &table->buckets[n->hash &
+							(table->size - 1)]);
+	}
+}
+
+static void nhrp_hash_migrate(struct nhrp_hash *table, unsigned int steps)
+{
+	while (table->old_buckets != NULL && steps-- != 0) {
+		nhrp_hash_migrate_bucket(table,
+					 &table->old_buckets[table->old_pos]);
+		if (++table->old_pos < table->old_size)
+			continue;
+
+		free(table->old_buckets);
+		table->old_buckets = NULL;
+		table->old_size = 0;
+	}
+}
+
+void nhrp_hash_finish_resize(struct nhrp_hash *table)
+{
+	nhrp_hash_migrate(table, table->old_size);
+}
+
+static void nhrp_hash_resize(struct nhrp_hash *table, unsigned int size)
+{
+	struct hlist_head *buckets;
+
+	/* Resizes are at least size / 2 operations apart, by which time
+	 * the previous one is long done; this is just a safety net */
+	nhrp_hash_finish_resize(table);
+
+	/* Without memory the table keeps working, just with longer chains */
+	buckets = calloc(size, sizeof(struct hlist_head));
+	if (buckets == NULL)
+		return;
+
+	table->old_buckets = table->buckets;
+	table->old_size = table->size;
+	table->old_pos = 0;
+	table->buckets = buckets;
+	table->size = size;
+	if (table->old_buckets == NULL)
+		table->old_size = 0;
+}
+
+struct hlist_head *nhrp_hash_bucket(struct nhrp_hash *table, unsigned int hash)
+{
+	if (table->size == 0)
+		return &empty_bucket;
+
+	/* Nodes with this hash still in the old array are moved first,
+	 * so the new bucket holds all of them */
+	if (table->old_buckets != NULL)
+		nhrp_hash_migrate_bucket(
+			table, &table->old_buckets[hash & (table->old_size - 1)]);
+
+	return &table->buckets[hash & (table->size - 1)];
+}
+
+void nhrp_hash_add(struct nhrp_hash *table, struct nhrp_hash_node *n,
+		   unsigned int hash)
+{
+	/* Keep the load factor at most one */
+	if (table->count >= table->size)
+		nhrp_hash_resize(table, table->size ? 2 * table->size
+						    : NHRP_HASH_MIN_SIZE);
+	nhrp_hash_migrate(table, NHRP_HASH_MIGRATE_STEP);
+
+	n->hash = hash;
+	hlist_add_head(&n->list, nhrp_hash_bucket(table, hash));
+	table->count++;
+}
+
+void nhrp_hash_del(struct nhrp_hash *table, struct nhrp_hash_node *n)
+{
+	hlist_del(&n->list);
+	table->count--;
+
+	if (table->size > NHRP_HASH_MIN_SIZE &&
+	    table->count < table->size / 8)
+		nhrp_hash_resize(table, table->size / 2);
+	nhrp_hash_migrate(table, NHRP_HASH_MIGRATE_STEP);
+}
+
+static unsigned int nhrp_hash_chain(struct hlist_head *bucket)
+{
+	struct hlist_node *n;
+	unsigned int len = 0;
+
+	hlist_for_each(n, bucket)
+		len++;
+
+	return len;
+}
+
+unsigned int nhrp_hash_max_chain(struct nhrp_hash *table)
+{
+	unsigned int i, len, max = 0;
+
+	for (i = 0; i < table->size; i++) {
+		len = nhrp_hash_chain(&table->buckets[i]);
+		if (len > max)
+			max = len;
+	}
+	for (i = table->old_pos; i < table->old_size; i++) {
+		len = nhrp_hash_chain(&table->old_buckets[i]);
+		if (len > max)
+			max = len;
+	}
+
+	return max;
+}
+
+void nhrp_hash_destroy(struct nhrp_hash *table)
+{
+	free(table->buckets);
+	free(table->old_buckets);
+	memset(table, 0, sizeof(*table));
+}
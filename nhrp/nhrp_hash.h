@@ -0,0 +1,64 @@
+/* nhrp_hash.h - Resizable hash table of intrusive nodes
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#ifndef NHRP_HASH_H
+#define NHRP_HASH_H
+
+#include <stdint.h>
+#include "list.h"
+#include "nhrp_address.h"
+
+struct nhrp_hash_node {
+	struct hlist_node list;
+	unsigned int hash;
+};
+
+/* Resizing moves the nodes over incrementally: the previous bucket
+ * array is kept until add, del and lookups have drained it. */
+struct nhrp_hash {
+	unsigned int size;
+	unsigned int count;
+	struct hlist_head *buckets;
+	unsigned int old_size, old_pos;
+	struct hlist_head *old_buckets;
+};
+
+/* Iterates all nodes in the bucket of 'hashval'; the caller still
+ * needs to compare the actual keys. */
+#define nhrp_hash_for_each_entry(tpos, pos, table, hashval, member)	 \
+	hlist_for_each_entry(tpos, pos,					 \
+			     nhrp_hash_bucket(table, hashval), member.list) \
+		if ((tpos)->member.hash == (hashval))
+
+extern uint32_t nhrp_hash_seed;
+
+static inline int nhrp_hash_hashed(const struct nhrp_hash_node *n)
+{
+	return hlist_hashed(&n->list);
+}
+
+void nhrp_hash_init(void);
+uint32_t nhrp_hash_bytes(const uint8_t *data, int len, uint32_t initval);
+
+/* Keyed with a random seed, so remote parties cannot pick addresses
+ * that collide; use nhrp_address_hash() for stable values. */
+static inline unsigned int nhrp_hash_address(const struct nhrp_address *addr)
+{
+	return nhrp_hash_bytes(addr->addr, addr->addr_len,
+			       nhrp_hash_seed ^ addr->type);
+}
+
+struct hlist_head *nhrp_hash_bucket(struct nhrp_hash *table, unsigned int hash);
+void nhrp_hash_add(struct nhrp_hash *table, struct nhrp_hash_node *n,
+		   unsigned int hash);
+void nhrp_hash_del(struct nhrp_hash *table, struct nhrp_hash_node *n);
+void nhrp_hash_finish_resize(struct nhrp_hash *table);
+void nhrp_hash_destroy(struct nhrp_hash *table);
+unsigned int nhrp_hash_max_chain(struct nhrp_hash *table);
+
+#endif
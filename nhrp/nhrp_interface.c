@@ -17,32 +17,13 @@
 #include "nhrp_common.h"
 #include "nhrp_interface.h"
 #include "nhrp_address.h"
+#include "nhrp_script.h"
 
 #define NHRP_INDEX_HASH_SIZE		(1 << 6)
 
 static struct list_head name_list = LIST_INITIALIZER(name_list);
 static struct hlist_head index_hash[NHRP_INDEX_HASH_SIZE];
 
-static char *env(const char *key, const char *value)
-{
-	char *buf;
-	buf = malloc(strlen(key)+strlen(value)+2);
-	if (buf == NULL)
-		return NULL;
-	sprintf(buf, "%s=%s", key, value);
-	return buf;
-}
-
-static char *envu32(const char *key, uint32_t value)
-{
-	char *buf;
-	buf = malloc(strlen(key)+16);
-	if (buf == NULL)
-		return NULL;
-	sprintf(buf, "%s=%u", key, value);
-	return buf;
-}
-
 void nhrp_interface_cleanup(void)
 {
 	struct nhrp_interface *iface, *n;
@@ -50,6 +31,11 @@ void nhrp_interface_cleanup(void)
 	list_for_each_entry_safe(iface, n, &name_list, name_list_entry) {
 		list_del(&iface->name_list_entry);
 		hlist_del(&iface->index_list_entry);
+		nhrp_hash_destroy(&iface->peer_hash);
+		nhrp_hash_destroy(&iface->nexthop_hash);
+		nhrp_hash_destroy(&iface->nbma_hash);
+		free(iface->mcast_msgs);
+		free(iface->mcast_dests);
 		free(iface);
 	}
 }
@@ -92,6 +78,7 @@ struct nhrp_interface *nhrp_interface_get_by_name(const char *name, int create)
 
 	iface = calloc(1, sizeof(struct nhrp_interface));
 	iface->holding_time = NHRP_DEFAULT_HOLDING_TIME;
+	iface->renew_jitter = NHRP_DEFAULT_RENEW_JITTER;
 	iface->route_table = RT_TABLE_MAIN;
 	strncpy(iface->name, name, sizeof(iface->name));
 
@@ -152,34 +139,25 @@ struct nhrp_interface *nhrp_interface_get_by_protocol(struct nhrp_address *addr)
 
 int nhrp_interface_run_script(struct nhrp_interface *iface, char *action)
 {
-	const char *argv[] = { nhrp_script_file, action, NULL };
-	char *envp[6];
-	pid_t pid;
-	int i = 0;
-
-	pid = fork();
-	if (pid == -1)
-		return FALSE;
-	if (pid > 0)
-		return TRUE;
-
-	envp[i++] = "NHRP_TYPE=INTERFACE";
-	envp[i++] = env("NHRP_INTERFACE", iface->name);
-	envp[i++] = envu32("NHRP_GRE_KEY", iface->gre_key);
-	envp[i++] = NULL;
-
-	execve(nhrp_script_file, (char **) argv, envp);
-	exit(1);
+	struct nhrp_script_env env;
+
+	nhrp_script_env_init(&env);
+	nhrp_script_env_add(&env, "NHRP_TYPE", "INTERFACE");
+	nhrp_script_env_add(&env, "NHRP_INTERFACE", iface->name);
+	nhrp_script_env_addu32(&env, "NHRP_GRE_KEY", iface->gre_key);
+
+	return nhrp_script_run(NULL, action, &env, NHRP_SCRIPT_PRIO_HIGH);
 }
 
 struct nhrp_peer *nhrp_interface_find_peer(struct nhrp_interface *iface,
 					   const struct nhrp_address *nbma)
 {
-	unsigned int key = nhrp_address_hash(nbma) % NHRP_INTERFACE_NBMA_HASH_SIZE;
+	unsigned int key = nhrp_hash_address(nbma);
 	struct nhrp_peer *peer;
 	struct hlist_node *n;
 
-	hlist_for_each_entry(peer, n, &iface->nbma_hash[key], nbma_hash_entry) {
+	nhrp_hash_for_each_entry(peer, n, &iface->nbma_hash, key,
+				 nbma_hash_entry) {
 		if (nhrp_address_cmp(nbma, &peer->next_hop_address) == 0)
 			return peer;
 	}
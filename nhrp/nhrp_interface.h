@@ -17,8 +17,13 @@
 #define NHRP_INTERFACE_FLAG_REDIRECT		0x0004	/* Send redirects */
 #define NHRP_INTERFACE_FLAG_SHORTCUT_DEST	0x0008	/* Advertise routes */
 #define NHRP_INTERFACE_FLAG_CONFIGURED		0x0010	/* Found in config file */
+#define NHRP_INTERFACE_FLAG_MCAST_OFFLOAD	0x0020	/* Kernel replicates multicast */
+#define NHRP_INTERFACE_FLAG_MARK		0x0040	/* Temporary mark during resync */
+#define NHRP_INTERFACE_FLAG_BUILTIN_ROUTE	0x0080	/* route-up/down via netlink */
+#define NHRP_INTERFACE_FLAG_BUILTIN_PEER	0x0100	/* peer-up/down via netlink */
 
-#define NHRP_INTERFACE_NBMA_HASH_SIZE		256
+struct mmsghdr;
+struct sockaddr_ll;
 
 struct nhrp_interface {
 	struct list_head name_list_entry;
@@ -28,6 +33,7 @@ struct nhrp_interface {
 	char name[16];
 	unsigned int flags;
 	unsigned int holding_time;
+	unsigned int renew_jitter;
 	struct nhrp_buffer *auth_token;
 	unsigned int route_table;
 
@@ -46,13 +52,26 @@ struct nhrp_interface {
 
         /* Peer cache is interface specific */
 	struct list_head peer_list;
-	struct hlist_head nbma_hash[NHRP_INTERFACE_NBMA_HASH_SIZE];
+	struct nhrp_trie peer_trie;
+	struct nhrp_hash peer_hash;
+	struct nhrp_hash nexthop_hash;
+	struct nhrp_hash nbma_hash;
+	unsigned int peer_count, peer_cold_count;
 
 	/* Multicast related stuff */
 	struct list_head mcast_list;
+	unsigned int mcast_generation;
 	int mcast_mask;
 	int mcast_numaddr;
 	struct nhrp_address *mcast_addr;
+
+	/* Replication vector, rebuilt from mcast_list when
+	 * mcast_generation changes */
+	struct mmsghdr *mcast_msgs;
+	struct sockaddr_ll *mcast_dests;
+	unsigned int mcast_dests_generation;
+	int mcast_num_dests, mcast_dests_alloc;
+	unsigned long mcast_tx_packets, mcast_tx_errors;
 };
 
 typedef int (*nhrp_interface_enumerator)(void *ctx, struct nhrp_interface *iface);
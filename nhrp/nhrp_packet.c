@@ -6,7 +6,9 @@
  * See MIT-LICENSE.txt for additional details.
  */
 
+#include <math.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -20,6 +22,8 @@
 
 #define PACKET_RETRIES			6
 #define PACKET_RETRY_INTERVAL		5.0
+#define PACKET_RETRY_MIN_INTERVAL	1.0
+#define PACKET_RETRY_MAX_INTERVAL	20.0
 
 #define RATE_LIMIT_HASH_SIZE		256
 #define RATE_LIMIT_MAX_TOKENS		4
@@ -29,6 +33,9 @@
 
 #define MAX_PDU_SIZE			1500
 
+#define POOL_DEFAULT_RESERVE		64
+#define POOL_BUFFER_SIZE		128
+
 struct nhrp_rate_limit {
 	struct hlist_node hash_entry;
 	struct nhrp_address src;
@@ -38,11 +45,31 @@ struct nhrp_rate_limit {
 };
 
 static uint32_t request_id = 0;
-static struct list_head pending_requests = LIST_INITIALIZER(pending_requests);
+static struct nhrp_hash pending_requests;
 static struct hlist_head rate_limit_hash[RATE_LIMIT_HASH_SIZE];
 static ev_timer rate_limit_timer;
 static int num_rate_limit_entries = 0;
 
+struct nhrp_request_stats nhrp_request_stats;
+
+struct nhrp_pool nhrp_packet_pools[NHRP_NUM_POOLS] = {
+	[NHRP_POOL_PACKET] = {
+		.name = "Packet",
+		.size = sizeof(struct nhrp_packet),
+		.reserve = POOL_DEFAULT_RESERVE,
+	},
+	[NHRP_POOL_CIE] = {
+		.name = "CIE",
+		.size = sizeof(struct nhrp_cie),
+		.reserve = POOL_DEFAULT_RESERVE,
+	},
+	[NHRP_POOL_BUFFER] = {
+		.name = "Buffer",
+		.size = sizeof(struct nhrp_buffer) + POOL_BUFFER_SIZE,
+		.reserve = POOL_DEFAULT_RESERVE,
+	},
+};
+
 static void nhrp_packet_xmit_timeout_cb(struct ev_timer *w, int revents);
 static int unmarshall_packet_header(uint8_t **pdu, size_t *pdusize,
 				    struct nhrp_packet *packet);
@@ -147,11 +174,67 @@ static uint16_t nhrp_calculate_checksum(uint8_t *pdu, uint16_t len)
 	return (~csum) & 0xffff;
 }
 
+/* Freed objects are kept on a per-type free list up to the reserve
+ * count. Objects are plain malloc() blocks so they can also be freed
+ * directly. */
+static void *nhrp_pool_alloc(struct nhrp_pool *pool)
+{
+	void *obj = pool->free_list;
+
+	if (obj != NULL) {
+		pool->free_list = *(void **) obj;
+		pool->free--;
+	} else {
+		obj = malloc(pool->size);
+	}
+
+	pool->used++;
+	if (pool->used > pool->peak)
+		pool->peak = pool->used;
+
+	return obj;
+}
+
+static void nhrp_pool_free(struct nhrp_pool *pool, void *obj)
+{
+	pool->used--;
+	if (pool->free >= pool->reserve) {
+		free(obj);
+		return;
+	}
+
+	*(void **) obj = pool->free_list;
+	pool->free_list = obj;
+	pool->free++;
+}
+
+void nhrp_packet_pool_reserve(unsigned int count)
+{
+	struct nhrp_pool *pool;
+	void *obj;
+	int i;
+
+	for (i = 0; i < NHRP_NUM_POOLS; i++) {
+		pool = &nhrp_packet_pools[i];
+		if (count > pool->reserve)
+			pool->reserve = count;
+		while (pool->free < count) {
+			obj = malloc(pool->size);
+			*(void **) obj = pool->free_list;
+			pool->free_list = obj;
+			pool->free++;
+		}
+	}
+}
+
 struct nhrp_buffer *nhrp_buffer_alloc(uint32_t size)
 {
 	struct nhrp_buffer *buf;
 
-	buf = malloc(sizeof(struct nhrp_buffer) + size);
+	if (size <= POOL_BUFFER_SIZE)
+		buf = nhrp_pool_alloc(&nhrp_packet_pools[NHRP_POOL_BUFFER]);
+	else
+		buf = malloc(sizeof(struct nhrp_buffer) + size);
 	buf->length = size;
 
 	return buf;
@@ -177,17 +260,27 @@ int nhrp_buffer_cmp(struct nhrp_buffer *a, struct nhrp_buffer *b)
 
 void nhrp_buffer_free(struct nhrp_buffer *buffer)
 {
-	free(buffer);
+	if (buffer == NULL)
+		return;
+	if (buffer->length <= POOL_BUFFER_SIZE)
+		nhrp_pool_free(&nhrp_packet_pools[NHRP_POOL_BUFFER], buffer);
+	else
+		free(buffer);
 }
 
 struct nhrp_cie *nhrp_cie_alloc(void)
 {
-	return calloc(1, sizeof(struct nhrp_cie));
+	struct nhrp_cie *cie;
+
+	cie = nhrp_pool_alloc(&nhrp_packet_pools[NHRP_POOL_CIE]);
+	memset(cie, 0, sizeof(struct nhrp_cie));
+
+	return cie;
 }
 
 void nhrp_cie_free(struct nhrp_cie *cie)
 {
-	free(cie);
+	nhrp_pool_free(&nhrp_packet_pools[NHRP_POOL_CIE], cie);
 }
 
 void nhrp_cie_reset(struct nhrp_cie *cie)
@@ -267,10 +360,11 @@ struct nhrp_cie *nhrp_payload_get_cie(struct nhrp_payload *payload, int index)
 struct nhrp_packet *nhrp_packet_alloc(void)
 {
 	struct nhrp_packet *packet;
-	packet = calloc(1, sizeof(struct nhrp_packet));
+
+	packet = nhrp_pool_alloc(&nhrp_packet_pools[NHRP_POOL_PACKET]);
+	memset(packet, 0, sizeof(struct nhrp_packet));
 	packet->ref = 1;
 	packet->hdr.hop_count = NHRP_PACKET_DEFAULT_HOP_COUNT;
-	list_init(&packet->request_list_entry);
 	ev_timer_init(&packet->timeout, nhrp_packet_xmit_timeout_cb,
 		      PACKET_RETRY_INTERVAL, PACKET_RETRY_INTERVAL);
 	return packet;
@@ -323,7 +417,7 @@ static void nhrp_packet_release(struct nhrp_packet *packet)
 		nhrp_peer_put(packet->dst_peer);
 	for (i = 0; i < packet->num_extensions; i++)
 		nhrp_payload_free(&packet->extension_by_order[i]);
-	free(packet);
+	nhrp_pool_free(&nhrp_packet_pools[NHRP_POOL_PACKET], packet);
 }
 
 void nhrp_packet_put(struct nhrp_packet *packet)
@@ -344,38 +438,111 @@ int nhrp_packet_reroute(struct nhrp_packet *packet, struct nhrp_peer *dst_peer)
 	return nhrp_packet_route(packet);
 }
 
-static void nhrp_packet_dequeue(struct nhrp_packet *packet)
+/* Pending requests are hashed on the request id only: the source
+ * addresses are filled in when the request is routed, which may happen
+ * after it is queued. Replies are still matched on all three. */
+static unsigned int nhrp_packet_request_hash(struct nhrp_packet *packet)
 {
-	ev_timer_stop(&packet->timeout);
-	if (list_hashed(&packet->request_list_entry))
-		list_del(&packet->request_list_entry);
-	nhrp_packet_put(packet);
+	return nhrp_hash_bytes((uint8_t *) &packet->hdr.u.request_id,
+			       sizeof(packet->hdr.u.request_id),
+			       nhrp_hash_seed);
 }
 
-static int nhrp_do_handle_error_indication(struct nhrp_packet *error_pkt,
-					   struct nhrp_packet *orig_pkt)
+static struct nhrp_packet *nhrp_packet_request_find(struct nhrp_packet *packet)
 {
 	struct nhrp_packet *req;
+	struct hlist_node *n;
+	unsigned int hash = nhrp_packet_request_hash(packet);
 
-	list_for_each_entry(req, &pending_requests, request_list_entry) {
-		if (orig_pkt->hdr.u.request_id != req->hdr.u.request_id)
+	nhrp_hash_for_each_entry(req, n, &pending_requests, hash,
+				 request_hash_entry) {
+		if (packet->hdr.u.request_id != req->hdr.u.request_id)
 			continue;
-
-		if (nhrp_address_cmp(&orig_pkt->src_nbma_address,
+		if (nhrp_address_cmp(&packet->src_nbma_address,
 				     &req->src_nbma_address))
 			continue;
-		if (nhrp_address_cmp(&orig_pkt->src_protocol_address,
+		if (nhrp_address_cmp(&packet->src_protocol_address,
 				     &req->src_protocol_address))
 			continue;
+		return req;
+	}
 
-		if (req->handler != NULL)
-			req->handler(req->handler_ctx, error_pkt);
-		nhrp_packet_dequeue(req);
+	return NULL;
+}
 
-		return TRUE;
+static void nhrp_packet_rtt_sample(struct nhrp_peer *peer, ev_tstamp rtt)
+{
+	struct nhrp_peer_cold *cold = nhrp_peer_cold(peer);
+
+	/* Smoothed round trip time and its variation as in RFC 6298 */
+	if (cold->srtt == 0) {
+		cold->srtt = rtt;
+		cold->rttvar = rtt / 2;
+	} else {
+		cold->rttvar = 0.75 * cold->rttvar +
+			       0.25 * fabs(cold->srtt - rtt);
+		cold->srtt = 0.875 * cold->srtt + 0.125 * rtt;
+	}
+}
+
+static ev_tstamp nhrp_packet_retry_interval(struct nhrp_packet *packet)
+{
+	struct nhrp_peer *peer = packet->dst_peer;
+	ev_tstamp rto = PACKET_RETRY_INTERVAL;
+
+	if (peer != NULL && peer->cold != NULL && peer->cold->srtt != 0) {
+		rto = peer->cold->srtt + 4 * peer->cold->rttvar;
+		if (rto < PACKET_RETRY_MIN_INTERVAL)
+			rto = PACKET_RETRY_MIN_INTERVAL;
+	}
+
+	/* Double for each retransmission and add 25% jitter either
+	 * way, so clients of a busy server do not retry in step */
+	rto = ldexp(rto, packet->retry);
+	if (rto > PACKET_RETRY_MAX_INTERVAL)
+		rto = PACKET_RETRY_MAX_INTERVAL;
+
+	return rto * (0.75 + 0.5 * random() / RAND_MAX);
+}
+
+static void nhrp_packet_request_matched(struct nhrp_packet *req)
+{
+	ev_tstamp latency = ev_now() - req->request_sent;
+
+	nhrp_request_stats.matched++;
+	nhrp_request_stats.latency_total += latency;
+	if (latency > nhrp_request_stats.latency_max)
+		nhrp_request_stats.latency_max = latency;
+
+	/* Replies to retransmitted requests are ambiguous (Karn) */
+	if (req->retry == 0 && req->dst_peer != NULL)
+		nhrp_packet_rtt_sample(req->dst_peer, latency);
+}
+
+static void nhrp_packet_dequeue(struct nhrp_packet *packet)
+{
+	ev_timer_stop(&packet->timeout);
+	if (nhrp_hash_hashed(&packet->request_hash_entry)) {
+		nhrp_hash_del(&pending_requests, &packet->request_hash_entry);
+		nhrp_request_stats.pending--;
 	}
+	nhrp_packet_put(packet);
+}
+
+static int nhrp_do_handle_error_indication(struct nhrp_packet *error_pkt,
+					   struct nhrp_packet *orig_pkt)
+{
+	struct nhrp_packet *req;
+
+	req = nhrp_packet_request_find(orig_pkt);
+	if (req == NULL)
+		return FALSE;
 
-	return FALSE;
+	if (req->handler != NULL)
+		req->handler(req->handler_ctx, error_pkt);
+	nhrp_packet_dequeue(req);
+
+	return TRUE;
 }
 
 static int nhrp_handle_error_indication(struct nhrp_packet *error_packet)
@@ -716,16 +883,9 @@ static int nhrp_packet_receive_local(struct nhrp_packet *packet)
 	char tmp[64], tmp2[64], tmp3[64];
 
 	if (packet_types[packet->hdr.type].type == NHRP_TYPE_REPLY) {
-		list_for_each_entry(req, &pending_requests, request_list_entry) {
-			if (packet->hdr.u.request_id != req->hdr.u.request_id)
-				continue;
-			if (nhrp_address_cmp(&packet->src_nbma_address,
-					     &req->src_nbma_address))
-				continue;
-			if (nhrp_address_cmp(&packet->src_protocol_address,
-					     &req->src_protocol_address))
-				continue;
-
+		req = nhrp_packet_request_find(packet);
+		if (req != NULL) {
+			nhrp_packet_request_matched(req);
 			if (req->handler != NULL)
 				req->handler(req->handler_ctx, packet);
 			nhrp_packet_dequeue(req);
@@ -734,6 +894,7 @@ static int nhrp_packet_receive_local(struct nhrp_packet *packet)
 		}
 
 		/* Reply to unsent request? */
+		nhrp_request_stats.unmatched++;
 		nhrp_info("Packet type %d from nbma src %s, proto src %s, "
 			  "proto dst %s dropped: no matching request",
 			  packet->hdr.type,
@@ -1063,6 +1224,7 @@ int nhrp_packet_marshall_and_send(struct nhrp_packet *packet)
 int nhrp_packet_route_and_send(struct nhrp_packet *packet)
 {
 	struct nhrp_payload *payload;
+	struct nhrp_peer_cold *cold;
 
 	if (packet->dst_peer == NULL || packet->dst_iface == NULL) {
 		if (!nhrp_packet_route(packet)) {
@@ -1120,9 +1282,10 @@ int nhrp_packet_route_and_send(struct nhrp_packet *packet)
 				       NHRP_PEER_FLAG_LOWER_UP))
 		return nhrp_packet_marshall_and_send(packet);
 
-	if (packet->dst_peer->queued_packet != NULL)
-		nhrp_packet_put(packet->dst_peer->queued_packet);
-	packet->dst_peer->queued_packet = nhrp_packet_get(packet);
+	cold = nhrp_peer_cold(packet->dst_peer);
+	if (cold->queued_packet != NULL)
+		nhrp_packet_put(cold->queued_packet);
+	cold->queued_packet = nhrp_packet_get(packet);
 
 	return TRUE;
 }
@@ -1164,14 +1327,13 @@ static void nhrp_packet_xmit_timeout_cb(struct ev_timer *w, int revents)
 	struct nhrp_packet *packet =
 		container_of(w, struct nhrp_packet, timeout);
 
-	list_del(&packet->request_list_entry);
-
 	if (packet->dst_peer != NULL &&
 	    ++packet->retry < PACKET_RETRIES) {
+		packet->timeout.repeat = nhrp_packet_retry_interval(packet);
+		ev_timer_again(&packet->timeout);
 		nhrp_packet_marshall_and_send(packet);
-
-		list_add(&packet->request_list_entry, &pending_requests);
 	} else {
+		nhrp_request_stats.timeouts++;
 		ev_timer_stop(&packet->timeout);
 		if (packet->dst_peer == NULL)
 			nhrp_error("nhrp_packet_xmit_timeout: no destination peer!");
@@ -1197,7 +1359,12 @@ int nhrp_packet_send_request(struct nhrp_packet *pkt,
 
 	packet->handler = handler;
 	packet->handler_ctx = ctx;
-	list_add(&packet->request_list_entry, &pending_requests);
+	packet->request_sent = ev_now();
+	nhrp_hash_add(&pending_requests, &packet->request_hash_entry,
+		      nhrp_packet_request_hash(packet));
+	nhrp_request_stats.pending++;
+	nhrp_request_stats.sent++;
+	packet->timeout.repeat = nhrp_packet_retry_interval(packet);
 	ev_timer_again(&packet->timeout);
 
 	return nhrp_packet_send(packet);
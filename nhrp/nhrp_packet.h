@@ -13,6 +13,7 @@
 #include "list.h"
 #include "nhrp_protocol.h"
 #include "nhrp_address.h"
+#include "nhrp_hash.h"
 
 #define NHRP_MAX_EXTENSIONS		10
 
@@ -58,7 +59,8 @@ struct nhrp_packet {
 	struct nhrp_payload		extension_by_order[NHRP_MAX_EXTENSIONS];
 	struct nhrp_payload *		extension_by_type[NHRP_MAX_EXTENSIONS];
 
-	struct list_head		request_list_entry;
+	struct nhrp_hash_node		request_hash_entry;
+	ev_tstamp			request_sent;
 	struct ev_timer			timeout;
 	void				(*handler)(void *ctx, struct nhrp_packet *packet);
 	void *				handler_ctx;
@@ -75,6 +77,35 @@ struct nhrp_packet {
 
 #define NHRP_EXTENSION_FLAG_NOCREATE	0x00010000
 
+#define NHRP_POOL_PACKET		0
+#define NHRP_POOL_CIE			1
+#define NHRP_POOL_BUFFER		2
+#define NHRP_NUM_POOLS			3
+
+struct nhrp_pool {
+	const char *name;
+	size_t size;
+	unsigned int reserve;
+	unsigned int used, free, peak;
+	void *free_list;
+};
+
+extern struct nhrp_pool nhrp_packet_pools[NHRP_NUM_POOLS];
+
+struct nhrp_request_stats {
+	unsigned long pending;
+	unsigned long sent;
+	unsigned long matched;
+	unsigned long unmatched;
+	unsigned long timeouts;
+	ev_tstamp latency_total;
+	ev_tstamp latency_max;
+};
+
+extern struct nhrp_request_stats nhrp_request_stats;
+
+void nhrp_packet_pool_reserve(unsigned int count);
+
 int nhrp_rate_limit_clear(struct nhrp_address *addr, int prefix_len);
 
 struct nhrp_buffer *nhrp_buffer_alloc(uint32_t size);
@@ -16,17 +16,28 @@
 #include "nhrp_common.h"
 #include "nhrp_peer.h"
 #include "nhrp_interface.h"
+#include "nhrp_script.h"
 
 #define NHRP_PEER_FORMAT_LEN		128
 
 #define NHRP_SCRIPT_TIMEOUT		(2*60)
 #define NHRP_NEGATIVE_CACHE_TIME	(3*60)
 
-#define NHRP_RETRY_REGISTER_TIME	(30 + random()/(RAND_MAX/60))
-#define NHRP_RETRY_ERROR_TIME		(60 + random()/(RAND_MAX/120))
+#define NHRP_RETRY_REGISTER_TIME	60
+#define NHRP_RETRY_ERROR_TIME		120
+#define NHRP_RETRY_MAX_TIME		960
+
+/* Longer peer timers go to the one second timing wheel */
+#define NHRP_PEER_WHEEL_TICK		1.0
+#define NHRP_PEER_WHEEL_MIN_TIMEOUT	10.0
 
 #define NHRP_PEER_FLAG_PRUNE_PENDING	0x00010000
 
+#define NHRP_ROUTE_CACHE_SIZE		256
+
+#define NHRP_PEER_SLAB_SIZE		16384
+#define NHRP_CACHE_LINE			64
+
 const char * const nhrp_peer_type[] = {
 	[NHRP_PEER_TYPE_INCOMPLETE]	= "incomplete",
 	[NHRP_PEER_TYPE_NEGATIVE]	= "negative",
@@ -42,6 +53,43 @@ const char * const nhrp_peer_type[] = {
 
 static int nhrp_peer_num_total = 0;
 static struct list_head local_peer_list = LIST_INITIALIZER(local_peer_list);
+static struct nhrp_trie local_peer_trie;
+static struct nhrp_hash local_peer_hash;
+static unsigned long nhrp_peer_cache_seq = 0;
+static unsigned long nhrp_peer_cache_generation = 1;
+
+struct nhrp_peer_stats nhrp_peer_stats;
+
+static void nhrp_peer_wheel_cb(struct nhrp_wheel *wheel,
+			       struct nhrp_wheel_timer *t);
+static struct nhrp_wheel peer_wheel =
+	NHRP_WHEEL_INITIALIZER(NHRP_PEER_WHEEL_TICK, nhrp_peer_wheel_cb);
+
+struct route_cache_entry {
+	unsigned long generation;
+	struct nhrp_interface *interface;
+	struct nhrp_peer *peer;
+	int flags, type_mask;
+	struct nhrp_address dst, src;
+};
+
+static struct route_cache_entry route_cache[NHRP_ROUTE_CACHE_SIZE];
+
+/* Peers are carved from slabs aligned to their own size, so the slab
+ * header is found by masking the peer address. Free peers are chained
+ * through peer_list_entry. */
+struct nhrp_peer_slab {
+	struct list_head slab_list_entry;
+	struct list_head free_list;
+	unsigned int used;
+};
+
+#define PEER_ALIGN(x)		(((x) + NHRP_CACHE_LINE - 1) & ~(NHRP_CACHE_LINE - 1))
+#define PEER_SLAB_HEADER	PEER_ALIGN(sizeof(struct nhrp_peer_slab))
+#define PEER_OBJECT_SIZE	PEER_ALIGN(sizeof(struct nhrp_peer))
+#define PEERS_PER_SLAB		((NHRP_PEER_SLAB_SIZE - PEER_SLAB_HEADER) / PEER_OBJECT_SIZE)
+
+static struct list_head peer_slab_partial = LIST_INITIALIZER(peer_slab_partial);
 
 static inline
 int holding_time_to_reregister_time(int holding_time)
@@ -62,6 +110,34 @@ int holding_time_to_expiry_time(int holding_time, int offset_time)
 	return expire + 1;
 }
 
+static int nhrp_peer_retry_time(struct nhrp_peer *peer, int timeout)
+{
+	struct nhrp_peer_cold *cold = nhrp_peer_cold(peer);
+	unsigned int i;
+
+	/* Double the interval on each consecutive failure, and spread
+	 * retries over half to one and a half times the interval. The
+	 * interval is capped so the spread stays within the maximum. */
+	for (i = 0; i < cold->retries && timeout < NHRP_RETRY_MAX_TIME; i++)
+		timeout *= 2;
+	if (timeout > NHRP_RETRY_MAX_TIME * 2 / 3)
+		timeout = NHRP_RETRY_MAX_TIME * 2 / 3;
+	cold->retries++;
+
+	return timeout / 2 + random() % (timeout + 1);
+}
+
+static int nhrp_peer_jitter(struct nhrp_peer *peer, int timeout)
+{
+	/* Renew a random fraction of the interval early, so that peers
+	 * which came up at the same time do not stay in lockstep */
+	int jitter = timeout * peer->interface->renew_jitter / 100;
+
+	if (jitter <= 0)
+		return timeout;
+	return timeout - random() % (jitter + 1);
+}
+
 /* Peer entrys life, pending callbacks and their call order are listed
  * here.
  *
@@ -113,6 +189,61 @@ int holding_time_to_expiry_time(int holding_time, int offset_time)
  * nothing, only netlink code modifies these
  */
 
+/* Invalidates all cached route lookups; needs to be called whenever
+ * a change in the peer cache could affect route decisions. */
+static inline void nhrp_peer_cache_changed(void)
+{
+	nhrp_peer_cache_generation++;
+}
+
+static struct nhrp_trie *nhrp_peer_trie(struct nhrp_peer *peer)
+{
+	if (peer->type == NHRP_PEER_TYPE_LOCAL_ADDR)
+		return &local_peer_trie;
+	return &peer->interface->peer_trie;
+}
+
+static struct nhrp_hash *nhrp_peer_hash(struct nhrp_peer *peer)
+{
+	if (peer->type == NHRP_PEER_TYPE_LOCAL_ADDR)
+		return &local_peer_hash;
+	return &peer->interface->peer_hash;
+}
+
+/* The prefix trie and protocol address hash must be updated whenever
+ * protocol address or prefix length of a cached peer changes. */
+static void nhrp_peer_index(struct nhrp_peer *peer)
+{
+	nhrp_peer_cache_changed();
+	peer->trie_node = nhrp_trie_get(nhrp_peer_trie(peer),
+					&peer->protocol_address,
+					peer->prefix_length);
+	list_add(&peer->trie_list_entry, &peer->trie_node->entries);
+	nhrp_hash_add(nhrp_peer_hash(peer), &peer->protocol_hash_entry,
+		      nhrp_hash_address(&peer->protocol_address));
+
+	/* Shortcut routes are found by their next hop on peer up/down */
+	if (peer->type == NHRP_PEER_TYPE_SHORTCUT_ROUTE)
+		nhrp_hash_add(&peer->interface->nexthop_hash,
+			      &peer->nexthop_hash_entry,
+			      nhrp_hash_address(&peer->next_hop_address));
+}
+
+static void nhrp_peer_unindex(struct nhrp_peer *peer)
+{
+	if (peer->trie_node == NULL)
+		return;
+
+	nhrp_peer_cache_changed();
+	list_del(&peer->trie_list_entry);
+	nhrp_trie_put(nhrp_peer_trie(peer), peer->trie_node);
+	peer->trie_node = NULL;
+	nhrp_hash_del(nhrp_peer_hash(peer), &peer->protocol_hash_entry);
+	if (nhrp_hash_hashed(&peer->nexthop_hash_entry))
+		nhrp_hash_del(&peer->interface->nexthop_hash,
+			      &peer->nexthop_hash_entry);
+}
+
 static void nhrp_peer_reinsert(struct nhrp_peer *peer, int type);
 static void nhrp_peer_restart_cb(struct ev_timer *w, int revents);
 static void nhrp_peer_dnsmap_restart_cb(struct ev_timer *w, int revents);
@@ -200,13 +331,13 @@ static char *nhrp_peer_format_full(struct nhrp_peer *peer, size_t len,
 			nhrp_address_format(&peer->next_hop_address,
 			sizeof(tmp), tmp));
 	}
-	if (peer->nbma_hostname != NULL) {
+	if (nhrp_peer_hostname(peer) != NULL) {
 		i += snprintf(&buf[i], len - i, " hostname %s",
-			peer->nbma_hostname);
+			nhrp_peer_hostname(peer));
 	}
-	if (peer->next_hop_nat_oa.type != PF_UNSPEC) {
+	if (nhrp_peer_nat_oa(peer) != NULL) {
 		i += snprintf(&buf[i], len - i, " nbma-nat-oa %s",
-			      nhrp_address_format(&peer->next_hop_nat_oa,
+			      nhrp_address_format(nhrp_peer_nat_oa(peer),
 						  sizeof(tmp), tmp));
 	}
 	if (peer->interface != NULL)
@@ -281,26 +412,6 @@ static void nhrp_peer_resolve_nbma(struct nhrp_peer *peer)
 	}
 }
 
-static char *env(const char *key, const char *value)
-{
-	char *buf;
-	buf = malloc(strlen(key)+strlen(value)+2);
-	if (buf == NULL)
-		return NULL;
-	sprintf(buf, "%s=%s", key, value);
-	return buf;
-}
-
-static char *envu32(const char *key, uint32_t value)
-{
-	char *buf;
-	buf = malloc(strlen(key)+16);
-	if (buf == NULL)
-		return NULL;
-	sprintf(buf, "%s=%u", key, value);
-	return buf;
-}
-
 int nhrp_peer_event_ok(union nhrp_peer_event e, int revents)
 {
 	int status;
@@ -340,76 +451,158 @@ char *nhrp_peer_event_reason(union nhrp_peer_event e, int revents,
 	return buf;
 }
 
+static void nhrp_peer_wheel_cb(struct nhrp_wheel *wheel,
+			       struct nhrp_wheel_timer *t)
+{
+	struct nhrp_peer *peer = container_of(t, struct nhrp_peer, wheel_timer);
+
+	ev_cb(&peer->timer)(&peer->timer, EV_TIMEOUT);
+}
+
+static void nhrp_peer_timer_stop(struct nhrp_peer *peer)
+{
+	ev_timer_stop(&peer->timer);
+	if (nhrp_wheel_pending(&peer->wheel_timer))
+		nhrp_wheel_del(&peer_wheel, &peer->wheel_timer);
+}
+
 struct nhrp_peer *nhrp_peer_from_event(union nhrp_peer_event e, int revents)
 {
 	struct nhrp_peer *peer;
 
 	if (revents & EV_CHILD) {
-		peer = container_of(e.child, struct nhrp_peer, child);
+		peer = container_of(e.child, struct nhrp_peer_cold,
+				    script.child)->peer;
 	} else if (revents & EV_TIMEOUT) {
 		peer = container_of(e.timer, struct nhrp_peer, timer);
 	} else {
+		/* Synthetic completions pass the peer timer */
 		NHRP_BUG_ON(revents != 0);
-		peer = container_of(e.child, struct nhrp_peer, child);
+		peer = container_of(e.timer, struct nhrp_peer, timer);
 	}
 
-	ev_child_stop(&peer->child);
-	ev_timer_stop(&peer->timer);
+	if (peer->cold != NULL)
+		nhrp_script_cancel(&peer->cold->script);
+	nhrp_peer_timer_stop(peer);
 
 	return peer;
 }
 
+static int nhrp_peer_script_priority(struct nhrp_peer *peer)
+{
+	/* Own addresses and the static core of the network come up first;
+	 * shortcuts only optimize paths that already work via the hub */
+	switch (peer->type) {
+	case NHRP_PEER_TYPE_LOCAL_ADDR:
+	case NHRP_PEER_TYPE_LOCAL_ROUTE:
+	case NHRP_PEER_TYPE_STATIC:
+	case NHRP_PEER_TYPE_DYNAMIC_NHS:
+		return NHRP_SCRIPT_PRIO_HIGH;
+	case NHRP_PEER_TYPE_DYNAMIC:
+		return NHRP_SCRIPT_PRIO_NORMAL;
+	}
+	return NHRP_SCRIPT_PRIO_LOW;
+}
+
+/* Performs the stock script's work for the action directly through
+ * netlink if the interface is configured to. Returns FALSE if the
+ * script needs to be run. */
+static int nhrp_peer_run_builtin(struct nhrp_peer *peer, const char *action,
+				 int *ok)
+{
+	unsigned int flags = peer->interface->flags;
+
+	if ((flags & NHRP_INTERFACE_FLAG_BUILTIN_ROUTE) &&
+	    peer->type == NHRP_PEER_TYPE_SHORTCUT_ROUTE) {
+		if (strcmp(action, "route-up") == 0)
+			*ok = kernel_route_update(TRUE, peer->interface,
+						  &peer->protocol_address,
+						  peer->prefix_length,
+						  &peer->next_hop_address);
+		else if (strcmp(action, "route-down") == 0)
+			*ok = kernel_route_update(FALSE, peer->interface,
+						  &peer->protocol_address,
+						  peer->prefix_length, NULL);
+		else
+			return FALSE;
+		return TRUE;
+	}
+
+	if ((flags & NHRP_INTERFACE_FLAG_BUILTIN_PEER) &&
+	    peer->type != NHRP_PEER_TYPE_SHORTCUT_ROUTE &&
+	    peer->type != NHRP_PEER_TYPE_LOCAL_ROUTE) {
+		if (strcmp(action, "peer-up") == 0)
+			*ok = peer->mtu == 0 ||
+			      kernel_nbma_route_update(TRUE,
+						       &peer->next_hop_address,
+						       &peer->my_nbma_address,
+						       peer->mtu);
+		else if (strcmp(action, "peer-down") == 0)
+			*ok = peer->mtu == 0 ||
+			      kernel_nbma_route_update(FALSE,
+						       &peer->next_hop_address,
+						       &peer->my_nbma_address,
+						       0);
+		else
+			return FALSE;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 void nhrp_peer_run_script(struct nhrp_peer *peer, char *action,
 			  void (*cb)(union nhrp_peer_event, int))
 {
 	struct nhrp_interface *iface = peer->interface;
-	const char *argv[] = { nhrp_script_file, action, NULL };
-	char *envp[32];
+	struct nhrp_script_env env;
+	struct nhrp_script *script = NULL;
 	char tmp[64];
-	pid_t pid;
-	int i = 0;
+	int ok;
+
+	if (cb != NULL) {
+		script = &nhrp_peer_cold(peer)->script;
+		nhrp_script_cancel(script);
+		ev_init(&script->child, cb);
+		nhrp_peer_timer_stop(peer);
+		ev_set_cb(&peer->timer, cb);
+		peer->timer.repeat = NHRP_SCRIPT_TIMEOUT;
+	}
 
-	/* Resolve own NBMA address before forking if required
-	 * since it requires traversing peer cache and can trigger
-	 * logging and other stuff. */
+	/* Resolve own NBMA address before building the environment */
 	if (peer->my_nbma_address.type == PF_UNSPEC)
 		nhrp_peer_resolve_nbma(peer);
 
-	/* Fork and execute script */
-	pid = fork();
-	if (pid == -1) {
-		if (cb != NULL)
-			cb(&peer->child, EV_CHILD | EV_ERROR);
-		return;
-	} else if (pid > 0) {
-		if (cb != NULL) {
-			ev_child_stop(&peer->child);
-			ev_child_init(&peer->child, cb, pid, 0);
-			ev_child_start(&peer->child);
-
-			ev_set_cb(&peer->timer, cb);
-			peer->timer.repeat = NHRP_SCRIPT_TIMEOUT;
-			ev_timer_again(&peer->timer);
+	if (nhrp_peer_run_builtin(peer, action, &ok)) {
+		if (cb == NULL)
+			return;
+		if (ok) {
+			cb(&peer->timer, 0);
+		} else {
+			script->child.rstatus = W_EXITCODE(1, 0);
+			cb(&script->child, EV_CHILD);
 		}
 		return;
 	}
 
-	envp[i++] = env("NHRP_TYPE", nhrp_peer_type[peer->type]);
+	nhrp_script_env_init(&env);
+	nhrp_script_env_add(&env, "NHRP_TYPE", nhrp_peer_type[peer->type]);
 	if (iface->protocol_address.type != PF_UNSPEC)
-		envp[i++] = env("NHRP_SRCADDR",
-				nhrp_address_format(&iface->protocol_address,
-						    sizeof(tmp), tmp));
+		nhrp_script_env_add(&env, "NHRP_SRCADDR",
+			nhrp_address_format(&iface->protocol_address,
+					    sizeof(tmp), tmp));
 	if (peer->my_nbma_address.type != PF_UNSPEC)
-		envp[i++] = env("NHRP_SRCNBMA",
-				nhrp_address_format(&peer->my_nbma_address,
-						    sizeof(tmp), tmp));
-	envp[i++] = env("NHRP_DESTADDR",
-			nhrp_address_format(&peer->protocol_address,
+		nhrp_script_env_add(&env, "NHRP_SRCNBMA",
+			nhrp_address_format(&peer->my_nbma_address,
 					    sizeof(tmp), tmp));
-	envp[i++] = envu32("NHRP_DESTPREFIX", peer->prefix_length);
+	nhrp_script_env_add(&env, "NHRP_DESTADDR",
+		nhrp_address_format(&peer->protocol_address,
+				    sizeof(tmp), tmp));
+	nhrp_script_env_addu32(&env, "NHRP_DESTPREFIX", peer->prefix_length);
 
 	if (peer->purge_reason)
-		envp[i++] = env("NHRP_PEER_DOWN_REASON", peer->purge_reason);
+		nhrp_script_env_add(&env, "NHRP_PEER_DOWN_REASON",
+				    peer->purge_reason);
 
 	switch (peer->type) {
 	case NHRP_PEER_TYPE_CACHED:
@@ -417,68 +610,79 @@ void nhrp_peer_run_script(struct nhrp_peer *peer, char *action,
 	case NHRP_PEER_TYPE_STATIC:
 	case NHRP_PEER_TYPE_DYNAMIC:
 	case NHRP_PEER_TYPE_DYNAMIC_NHS:
-		envp[i++] = env("NHRP_DESTNBMA",
+		nhrp_script_env_add(&env, "NHRP_DESTNBMA",
 			nhrp_address_format(&peer->next_hop_address,
 					    sizeof(tmp), tmp));
 		if (peer->mtu)
-			envp[i++] = envu32("NHRP_DESTMTU", peer->mtu);
-		if (peer->next_hop_nat_oa.type != PF_UNSPEC)
-			envp[i++] = env("NHRP_DESTNBMA_NAT_OA",
-				nhrp_address_format(&peer->next_hop_nat_oa,
+			nhrp_script_env_addu32(&env, "NHRP_DESTMTU", peer->mtu);
+		if (nhrp_peer_nat_oa(peer) != NULL)
+			nhrp_script_env_add(&env, "NHRP_DESTNBMA_NAT_OA",
+				nhrp_address_format(nhrp_peer_nat_oa(peer),
 						    sizeof(tmp), tmp));
 		break;
 	case NHRP_PEER_TYPE_SHORTCUT_ROUTE:
 	case NHRP_PEER_TYPE_LOCAL_ROUTE:
-		envp[i++] = env("NHRP_NEXTHOP",
+		nhrp_script_env_add(&env, "NHRP_NEXTHOP",
 			nhrp_address_format(&peer->next_hop_address,
 					    sizeof(tmp), tmp));
 		break;
 	default:
 		NHRP_BUG_ON("invalid peer type");
 	}
-	envp[i++] = env("NHRP_INTERFACE", peer->interface->name);
-	envp[i++] = envu32("NHRP_GRE_KEY", peer->interface->gre_key);
-	envp[i++] = NULL;
+	nhrp_script_env_add(&env, "NHRP_INTERFACE", peer->interface->name);
+	nhrp_script_env_addu32(&env, "NHRP_GRE_KEY", peer->interface->gre_key);
 
-	execve(nhrp_script_file, (char **) argv, envp);
-	exit(1);
+	/* The script timeout is started once the script leaves the queue */
+	if (!nhrp_script_run(script, action, &env,
+			     nhrp_peer_script_priority(peer))) {
+		if (cb != NULL)
+			cb(&script->child, EV_CHILD | EV_ERROR);
+	}
 }
 
 void nhrp_peer_cancel_async(struct nhrp_peer *peer)
 {
-	if (peer->queued_packet) {
-		nhrp_packet_put(peer->queued_packet);
-		peer->queued_packet = NULL;
-	}
+	struct nhrp_peer_cold *cold = peer->cold;
+
 	if (peer->request) {
 		nhrp_server_finish_request(peer->request);
 		peer->request = NULL;
 	}
+	nhrp_peer_timer_stop(peer);
 
-	nhrp_address_resolve_cancel(&peer->address_query);
-	ev_timer_stop(&peer->timer);
-	if (ev_is_active(&peer->child)) {
-		kill(SIGINT, peer->child.pid);
-		ev_child_stop(&peer->child);
+	if (cold == NULL)
+		return;
+
+	if (cold->queued_packet) {
+		nhrp_packet_put(cold->queued_packet);
+		cold->queued_packet = NULL;
 	}
+	nhrp_address_resolve_cancel(&cold->address_query);
+	kernel_route_cancel(&cold->route_query);
+	nhrp_script_cancel(&cold->script);
 }
 
 void nhrp_peer_send_packet_queue(struct nhrp_peer *peer)
 {
-	if (peer->queued_packet == NULL)
+	struct nhrp_peer_cold *cold = peer->cold;
+
+	if (cold == NULL || cold->queued_packet == NULL)
 		return;
 
-	nhrp_packet_marshall_and_send(peer->queued_packet);
-	nhrp_packet_put(peer->queued_packet);
-	peer->queued_packet = NULL;
+	nhrp_packet_marshall_and_send(cold->queued_packet);
+	nhrp_packet_put(cold->queued_packet);
+	cold->queued_packet = NULL;
 }
 
 static void nhrp_peer_schedule(struct nhrp_peer *peer, ev_tstamp timeout,
 			       void (*cb)(struct ev_timer *w, int revents))
 {
-	ev_timer_stop(&peer->timer);
+	nhrp_peer_timer_stop(peer);
 	ev_timer_init(&peer->timer, cb, timeout, 0.);
-	ev_timer_start(&peer->timer);
+	if (timeout >= NHRP_PEER_WHEEL_MIN_TIMEOUT)
+		nhrp_wheel_add(&peer_wheel, &peer->wheel_timer, timeout);
+	else
+		ev_timer_start(&peer->timer);
 }
 
 static void nhrp_peer_restart_error(struct nhrp_peer *peer)
@@ -487,7 +691,8 @@ static void nhrp_peer_restart_error(struct nhrp_peer *peer)
 	case NHRP_PEER_TYPE_STATIC:
 	case NHRP_PEER_TYPE_STATIC_DNS:
 	case NHRP_PEER_TYPE_DYNAMIC_NHS:
-		nhrp_peer_schedule(peer, NHRP_RETRY_ERROR_TIME,
+		nhrp_peer_schedule(peer,
+				   nhrp_peer_retry_time(peer, NHRP_RETRY_ERROR_TIME),
 				   nhrp_peer_restart_cb);
 		break;
 	default:
@@ -508,9 +713,11 @@ static void nhrp_peer_script_route_up_done(union nhrp_peer_event e, int revents)
 						       sizeof(tmp), tmp));
 
 		peer->flags |= NHRP_PEER_FLAG_UP;
+		nhrp_peer_cache_changed();
 		nhrp_peer_schedule(
 			peer,
-			holding_time_to_expiry_time(peer->expire_time - ev_now(), 10),
+			nhrp_peer_jitter(peer, holding_time_to_expiry_time(
+				peer->expire_time - ev_now(), 10)),
 			nhrp_peer_expire_cb);
 	} else {
 		nhrp_info("[%s] Route up script: %s; "
@@ -601,6 +808,50 @@ static void nhrp_peer_expire_cb(struct ev_timer *w, int revents)
 		nhrp_peer_renew(peer);
 }
 
+static void nhrp_peer_mcast_add_replica(struct nhrp_peer *peer)
+{
+	nhrp_peer_run_script(peer, "multicast-add", NULL);
+	nhrp_peer_cold(peer)->mcast_nbma = peer->next_hop_address;
+}
+
+static void nhrp_peer_mcast_del_replica(struct nhrp_peer *peer)
+{
+	struct nhrp_peer_cold *cold = peer->cold;
+	struct nhrp_address nbma;
+	struct nhrp_peer *p;
+
+	if (cold == NULL || cold->mcast_nbma.type == PF_UNSPEC)
+		return;
+
+	/* The replica is keyed on the NBMA address, so keep it if
+	 * another peer, e.g. our replacement, still uses it */
+	list_for_each_entry(p, &peer->interface->mcast_list, mcast_list_entry) {
+		if (p != peer && p->cold != NULL &&
+		    nhrp_address_cmp(&p->cold->mcast_nbma,
+				     &cold->mcast_nbma) == 0)
+			goto done;
+	}
+
+	/* The script environment is built synchronously, so it can be
+	 * pointed to the NBMA address the replica was added with */
+	nbma = peer->next_hop_address;
+	peer->next_hop_address = cold->mcast_nbma;
+	nhrp_peer_run_script(peer, "multicast-del", NULL);
+	peer->next_hop_address = nbma;
+done:
+	nhrp_address_set_type(&cold->mcast_nbma, PF_UNSPEC);
+}
+
+static void nhrp_peer_mcast_del(struct nhrp_peer *peer)
+{
+	if (!list_hashed(&peer->mcast_list_entry))
+		return;
+
+	list_del(&peer->mcast_list_entry);
+	peer->interface->mcast_generation++;
+	nhrp_peer_mcast_del_replica(peer);
+}
+
 static void nhrp_peer_is_down(struct nhrp_peer *peer)
 {
 	struct nhrp_peer_selector sel;
@@ -609,6 +860,7 @@ static void nhrp_peer_is_down(struct nhrp_peer *peer)
 	 * lookups are valid */
 	if (!(peer->flags & NHRP_PEER_FLAG_REMOVED))
 		peer->flags &= ~(NHRP_PEER_FLAG_LOWER_UP | NHRP_PEER_FLAG_UP);
+	nhrp_peer_cache_changed();
 
 	/* Check if there are routes using this peer as next-hop */
 	if (peer->type != NHRP_PEER_TYPE_SHORTCUT_ROUTE) {
@@ -620,10 +872,10 @@ static void nhrp_peer_is_down(struct nhrp_peer *peer)
 	}
 
 	/* Remove from lists */
-	if (list_hashed(&peer->mcast_list_entry))
-		list_del(&peer->mcast_list_entry);
-	if (hlist_hashed(&peer->nbma_hash_entry))
-		hlist_del(&peer->nbma_hash_entry);
+	nhrp_peer_mcast_del(peer);
+	if (nhrp_hash_hashed(&peer->nbma_hash_entry))
+		nhrp_hash_del(&peer->interface->nbma_hash,
+			      &peer->nbma_hash_entry);
 }
 
 static void nhrp_peer_is_up(struct nhrp_peer *peer)
@@ -639,10 +891,6 @@ static void nhrp_peer_is_up(struct nhrp_peer *peer)
 		nhrp_peer_run_script(peer, "nhs-up", NULL);
 	}
 
-	/* Remove from mcast list if previously there */
-	if (list_hashed(&peer->mcast_list_entry))
-		list_del(&peer->mcast_list_entry);
-
 	/* Check if this one needs multicast traffic */
 	if (BIT(peer->type) & iface->mcast_mask) {
 		mcast = 1;
@@ -656,25 +904,44 @@ static void nhrp_peer_is_up(struct nhrp_peer *peer)
 		}
 	}
 
-	if (mcast) {
+	if (!mcast) {
+		nhrp_peer_mcast_del(peer);
+	} else if (list_hashed(&peer->mcast_list_entry)) {
+		/* NBMA address might have changed */
+		iface->mcast_generation++;
+		if ((iface->flags & NHRP_INTERFACE_FLAG_MCAST_OFFLOAD) &&
+		    (peer->cold == NULL ||
+		     nhrp_address_cmp(&peer->cold->mcast_nbma,
+				      &peer->next_hop_address) != 0)) {
+			nhrp_peer_mcast_del_replica(peer);
+			nhrp_peer_mcast_add_replica(peer);
+		}
+	} else {
 		list_add(&peer->mcast_list_entry, &iface->mcast_list);
+		iface->mcast_generation++;
 		nhrp_info("[%s] Peer inserted to multicast list",
 			   nhrp_address_format(&peer->protocol_address,
 					       sizeof(tmp), tmp));
+		if (iface->flags & NHRP_INTERFACE_FLAG_MCAST_OFFLOAD)
+			nhrp_peer_mcast_add_replica(peer);
 	}
 
 	/* Searchable by NBMA */
-	if (hlist_hashed(&peer->nbma_hash_entry))
-		hlist_del(&peer->nbma_hash_entry);
+	if (nhrp_hash_hashed(&peer->nbma_hash_entry))
+		nhrp_hash_del(&peer->interface->nbma_hash,
+			      &peer->nbma_hash_entry);
 	if (BIT(peer->type) & (BIT(NHRP_PEER_TYPE_CACHED) |
 			       BIT(NHRP_PEER_TYPE_DYNAMIC) |
 			       BIT(NHRP_PEER_TYPE_DYNAMIC_NHS) |
 			       BIT(NHRP_PEER_TYPE_STATIC))) {
-		i = nhrp_address_hash(&peer->next_hop_address) % NHRP_INTERFACE_NBMA_HASH_SIZE;
-		hlist_add_head(&peer->nbma_hash_entry, &iface->nbma_hash[i]);
+		nhrp_hash_add(&iface->nbma_hash, &peer->nbma_hash_entry,
+			      nhrp_hash_address(&peer->next_hop_address));
 	}
 
 	peer->flags |= NHRP_PEER_FLAG_UP | NHRP_PEER_FLAG_LOWER_UP;
+	nhrp_peer_cache_changed();
+	if (peer->cold != NULL)
+		peer->cold->retries = 0;
 
 	/* Check if there are routes using this peer as next-hop*/
 	if (peer->type != NHRP_PEER_TYPE_SHORTCUT_ROUTE) {
@@ -696,7 +963,8 @@ static void nhrp_peer_is_up(struct nhrp_peer *peer)
 	case NHRP_PEER_TYPE_CACHED:
 		nhrp_peer_schedule(
 			peer,
-			holding_time_to_expiry_time(peer->expire_time - ev_now(), 0),
+			nhrp_peer_jitter(peer, holding_time_to_expiry_time(
+				peer->expire_time - ev_now(), 0)),
 			nhrp_peer_expire_cb);
 		break;
 	case NHRP_PEER_TYPE_STATIC:
@@ -704,7 +972,8 @@ static void nhrp_peer_is_up(struct nhrp_peer *peer)
 		if (peer->flags & NHRP_PEER_FLAG_REGISTER) {
 			nhrp_peer_schedule(
 				peer,
-				holding_time_to_reregister_time(iface->holding_time),
+				nhrp_peer_jitter(peer, holding_time_to_reregister_time(
+					iface->holding_time)),
 				nhrp_peer_send_register_cb);
 		}
 		break;
@@ -757,38 +1026,65 @@ static void nhrp_peer_run_up_script(struct nhrp_peer *peer)
 static void nhrp_peer_address_query_cb(struct nhrp_address_query *query,
 				       int num_addr, struct nhrp_address *addrs)
 {
-	struct nhrp_peer *peer = container_of(query, struct nhrp_peer,
-					      address_query);
+	struct nhrp_peer *peer = container_of(query, struct nhrp_peer_cold,
+					      address_query)->peer;
 	char host[64];
 
 	if (num_addr > 0) {
 		nhrp_info("Resolved '%s' as %s",
-			  peer->nbma_hostname,
+			  peer->cold->nbma_hostname,
 			  nhrp_address_format(&addrs[0], sizeof(host), host));
 		peer->next_hop_address = addrs[0];
 		peer->afnum = nhrp_afnum_from_pf(peer->next_hop_address.type);
 		nhrp_peer_run_up_script(peer);
 	} else {
-		nhrp_error("Failed to resolve '%s'", peer->nbma_hostname);
+		nhrp_error("Failed to resolve '%s'", peer->cold->nbma_hostname);
 		nhrp_peer_restart_error(peer);
 	}
 }
 
+static void nhrp_peer_restart_up(struct nhrp_peer *peer)
+{
+	if (!(peer->flags & NHRP_PEER_FLAG_LOWER_UP))
+		nhrp_peer_run_up_script(peer);
+	else
+		nhrp_peer_script_peer_up_done(&peer->timer, 0);
+}
+
+static void nhrp_peer_route_query_cb(struct kernel_route_query *query, int ok)
+{
+	struct nhrp_peer *peer =
+		container_of(query, struct nhrp_peer_cold, route_query)->peer;
+	char tmp[64];
+
+	if (ok) {
+		peer->my_nbma_address = query->source;
+		peer->my_nbma_mtu = query->mtu;
+	} else {
+		nhrp_error("No route to next hop address %s",
+			   nhrp_address_format(&peer->next_hop_address,
+					       sizeof(tmp), tmp));
+	}
+
+	nhrp_peer_restart_up(peer);
+}
+
 static void nhrp_peer_restart_cb(struct ev_timer *w, int revents)
 {
 	struct nhrp_peer *peer = container_of(w, struct nhrp_peer, timer);
 
-	if (peer->nbma_hostname != NULL) {
-		nhrp_address_resolve(&peer->address_query,
-				     peer->nbma_hostname,
+	if (nhrp_peer_hostname(peer) != NULL) {
+		nhrp_address_resolve(&peer->cold->address_query,
+				     peer->cold->nbma_hostname,
 				     nhrp_peer_address_query_cb);
+	} else if (peer->interface->nbma_address.type == PF_UNSPEC) {
+		kernel_route_query(&nhrp_peer_cold(peer)->route_query, NULL,
+				   &peer->next_hop_address,
+				   &peer->my_nbma_address,
+				   nhrp_peer_route_query_cb);
 	} else {
 		nhrp_peer_resolve_nbma(peer);
-
-		if (!(peer->flags & NHRP_PEER_FLAG_LOWER_UP))
-			nhrp_peer_run_up_script(peer);
-		else
-			nhrp_peer_script_peer_up_done(&peer->child, 0);
+		nhrp_peer_restart_up(peer);
 	}
 }
 
@@ -917,7 +1213,9 @@ int nhrp_peer_discover_nhs(struct nhrp_peer *peer,
 	nhrp_peer_foreach(nhrp_peer_remove_matching, NULL, &sel);
 
 	/* Update protocol address */
+	nhrp_peer_unindex(peer);
 	peer->protocol_address = *newaddr;
+	nhrp_peer_index(peer);
 
 	return TRUE;
 }
@@ -948,8 +1246,9 @@ static void nhrp_peer_handle_registration_reply(void *ctx,
 					       &reply->src_protocol_address);
 
 		if (reply != NULL) {
-			nhrp_peer_schedule(peer, NHRP_RETRY_REGISTER_TIME,
-					   nhrp_peer_send_register_cb);
+			nhrp_peer_schedule(peer,
+				nhrp_peer_retry_time(peer, NHRP_RETRY_REGISTER_TIME),
+				nhrp_peer_send_register_cb);
 		} else {
 			nhrp_peer_restart_error(peer);
 		}
@@ -981,9 +1280,20 @@ static void nhrp_peer_handle_registration_reply(void *ctx,
 	case NHRP_CODE_UNIQUE_ADDRESS_REGISTERED:
 		nhrp_peer_send_protocol_purge(peer);
 		goto ret;
+	case NHRP_CODE_INSUFFICIENT_RESOURCES:
+		/* A busy server passes the back-off time in the holding
+		 * time; a plain echo of our own holding time is not one */
+		if (cie != NULL && ntohs(cie->hdr.holding_time) != 0 &&
+		    ntohs(cie->hdr.holding_time) < peer->interface->holding_time) {
+			nhrp_peer_schedule(peer, ntohs(cie->hdr.holding_time),
+					   nhrp_peer_send_register_cb);
+			goto ret;
+		}
+		/* Fall through */
 	default:
-		nhrp_peer_schedule(peer, NHRP_RETRY_REGISTER_TIME,
-				   nhrp_peer_send_register_cb);
+		nhrp_peer_schedule(peer,
+			nhrp_peer_retry_time(peer, NHRP_RETRY_REGISTER_TIME),
+			nhrp_peer_send_register_cb);
 		goto ret;
 	}
 
@@ -1246,13 +1556,16 @@ static void nhrp_peer_handle_resolution_reply(void *ctx,
 	    == 0) {
 		/* Destination is within NBMA network; update cache */
 		peer->mtu = ntohs(cie->hdr.mtu);
-		peer->prefix_length = cie->hdr.prefix_length;
 		peer->next_hop_address = natcie->nbma_address;
 		if (natoacie != NULL)
-			peer->next_hop_nat_oa = natoacie->nbma_address;
+			nhrp_peer_cold(peer)->next_hop_nat_oa =
+				natoacie->nbma_address;
 		peer->expire_time = ev_now() + ntohs(cie->hdr.holding_time);
+		nhrp_peer_unindex(peer);
+		peer->prefix_length = cie->hdr.prefix_length;
 		nhrp_address_set_network(&peer->protocol_address,
 					 peer->prefix_length);
+		nhrp_peer_index(peer);
 		nhrp_peer_reinsert(peer, NHRP_PEER_TYPE_CACHED);
 		goto ret;
 	}
@@ -1287,7 +1600,8 @@ static void nhrp_peer_handle_resolution_reply(void *ctx,
 		np->protocol_address = cie->protocol_address;
 		np->next_hop_address = natcie->nbma_address;
 		if (natoacie != NULL)
-			np->next_hop_nat_oa = natoacie->nbma_address;
+			nhrp_peer_cold(np)->next_hop_nat_oa =
+				natoacie->nbma_address;
 		np->mtu = ntohs(cie->hdr.mtu);
 		np->prefix_length = cie->protocol_address.addr_len * 8;
 		np->expire_time = ev_now() + ntohs(cie->hdr.holding_time);
@@ -1382,22 +1696,118 @@ error:
 	nhrp_packet_put(packet);
 }
 
+static struct nhrp_peer_slab *nhrp_peer_slab_create(void)
+{
+	struct nhrp_peer_slab *slab;
+	struct nhrp_peer *p;
+	void *mem;
+	int i;
+
+	if (posix_memalign(&mem, NHRP_PEER_SLAB_SIZE, NHRP_PEER_SLAB_SIZE) != 0)
+		return NULL;
+
+	slab = mem;
+	slab->used = 0;
+	list_init(&slab->free_list);
+	for (i = 0; i < PEERS_PER_SLAB; i++) {
+		p = (struct nhrp_peer *) ((char *) mem + PEER_SLAB_HEADER +
+					  i * PEER_OBJECT_SIZE);
+		list_add_tail(&p->peer_list_entry, &slab->free_list);
+	}
+	list_add(&slab->slab_list_entry, &peer_slab_partial);
+
+	nhrp_peer_stats.peer_slabs++;
+	nhrp_peer_stats.peer_slab_bytes += NHRP_PEER_SLAB_SIZE;
+
+	return slab;
+}
+
+static struct nhrp_peer *nhrp_peer_slab_alloc(void)
+{
+	struct nhrp_peer_slab *slab;
+	struct nhrp_peer *p;
+
+	slab = list_next(&peer_slab_partial, struct nhrp_peer_slab,
+			 slab_list_entry);
+	if (slab == NULL) {
+		slab = nhrp_peer_slab_create();
+		if (slab == NULL)
+			return NULL;
+	}
+
+	p = list_next(&slab->free_list, struct nhrp_peer, peer_list_entry);
+	list_del(&p->peer_list_entry);
+	if (++slab->used == PEERS_PER_SLAB)
+		list_del(&slab->slab_list_entry);
+
+	memset(p, 0, sizeof(struct nhrp_peer));
+	return p;
+}
+
+static void nhrp_peer_slab_free(struct nhrp_peer *p)
+{
+	struct nhrp_peer_slab *slab;
+
+	slab = (struct nhrp_peer_slab *)
+		((unsigned long) p & ~(unsigned long) (NHRP_PEER_SLAB_SIZE - 1));
+
+	if (slab->used-- == PEERS_PER_SLAB)
+		list_add(&slab->slab_list_entry, &peer_slab_partial);
+	list_add(&p->peer_list_entry, &slab->free_list);
+
+	/* Keep one empty slab around to avoid thrashing */
+	if (slab->used != 0 ||
+	    (peer_slab_partial.next == &slab->slab_list_entry &&
+	     peer_slab_partial.prev == &slab->slab_list_entry))
+		return;
+
+	list_del(&slab->slab_list_entry);
+	free(slab);
+
+	nhrp_peer_stats.peer_slabs--;
+	nhrp_peer_stats.peer_slab_bytes -= NHRP_PEER_SLAB_SIZE;
+}
+
+size_t nhrp_peer_object_size(void)
+{
+	return PEER_OBJECT_SIZE;
+}
+
 struct nhrp_peer *nhrp_peer_alloc(struct nhrp_interface *iface)
 {
 	struct nhrp_peer *p;
 
 	nhrp_peer_num_total++;
-	p = calloc(1, sizeof(struct nhrp_peer));
+	p = nhrp_peer_slab_alloc();
 	p->ref = 1;
 	p->interface = iface;
 	list_init(&p->peer_list_entry);
 	list_init(&p->mcast_list_entry);
+	list_init(&p->trie_list_entry);
+	list_init(&p->wheel_timer.entry);
 	ev_timer_init(&p->timer, NULL, 0., 0.);
-	ev_child_init(&p->child, NULL, 0, 0);
+	iface->peer_count++;
 
 	return p;
 }
 
+struct nhrp_peer_cold *nhrp_peer_cold(struct nhrp_peer *peer)
+{
+	struct nhrp_peer_cold *cold = peer->cold;
+
+	if (cold != NULL)
+		return cold;
+
+	cold = calloc(1, sizeof(struct nhrp_peer_cold));
+	cold->peer = peer;
+	ev_child_init(&cold->script.child, NULL, 0, 0);
+	cold->script.timeout = &peer->timer;
+	peer->cold = cold;
+	peer->interface->peer_cold_count++;
+
+	return cold;
+}
+
 struct nhrp_peer *nhrp_peer_get(struct nhrp_peer *peer)
 {
 	if (peer == NULL)
@@ -1426,10 +1836,10 @@ static void nhrp_peer_release(struct nhrp_peer *peer)
 	nhrp_peer_cancel_async(peer);
 
 	/* Remove from lists */
-	if (list_hashed(&peer->mcast_list_entry))
-		list_del(&peer->mcast_list_entry);
-	if (hlist_hashed(&peer->nbma_hash_entry))
-		hlist_del(&peer->nbma_hash_entry);
+	nhrp_peer_mcast_del(peer);
+	if (nhrp_hash_hashed(&peer->nbma_hash_entry))
+		nhrp_hash_del(&peer->interface->nbma_hash,
+			      &peer->nbma_hash_entry);
 
 	if (peer->parent != NULL) {
 		nhrp_peer_put(peer->parent);
@@ -1480,12 +1890,17 @@ static void nhrp_peer_release(struct nhrp_peer *peer)
 		break;
 	}
 
-	if (peer->nbma_hostname) {
-		free(peer->nbma_hostname);
-		peer->nbma_hostname = NULL;
+	if (peer->cold != NULL) {
+		kernel_route_cancel(&peer->cold->route_query);
+		if (peer->cold->nbma_hostname)
+			free(peer->cold->nbma_hostname);
+		free(peer->cold);
+		peer->cold = NULL;
+		iface->peer_cold_count--;
 	}
 
-	free(peer);
+	iface->peer_count--;
+	nhrp_peer_slab_free(peer);
 	nhrp_peer_num_total--;
 }
 
@@ -1520,12 +1935,12 @@ static void nhrp_peer_dnsmap_query_cb(struct nhrp_address_query *query,
 				      int num_addr, struct nhrp_address *addrs)
 {
 	struct nhrp_peer *np, *peer =
-		container_of(query, struct nhrp_peer, address_query);
+		container_of(query, struct nhrp_peer_cold, address_query)->peer;
 	struct nhrp_peer_selector sel;
 	int i;
 
 	if (num_addr < 0) {
-		nhrp_error("Failed to resolve '%s'", peer->nbma_hostname);
+		nhrp_error("Failed to resolve '%s'", peer->cold->nbma_hostname);
 		nhrp_peer_schedule(peer, 10, nhrp_peer_dnsmap_restart_cb);
 		return;
 	}
@@ -1579,8 +1994,9 @@ static void nhrp_peer_dnsmap_restart_cb(struct ev_timer *w, int revents)
 {
 	struct nhrp_peer *peer = container_of(w, struct nhrp_peer, timer);
 
-	NHRP_BUG_ON(peer->nbma_hostname == NULL);
-	nhrp_address_resolve(&peer->address_query, peer->nbma_hostname,
+	NHRP_BUG_ON(nhrp_peer_hostname(peer) == NULL);
+	nhrp_address_resolve(&peer->cold->address_query,
+			     peer->cold->nbma_hostname,
 			     nhrp_peer_dnsmap_query_cb);
 }
 
@@ -1592,10 +2008,12 @@ static void nhrp_peer_insert_cb(struct ev_timer *w, int revents)
 	switch (peer->type) {
 	case NHRP_PEER_TYPE_LOCAL_ADDR:
 		peer->flags |= NHRP_PEER_FLAG_UP;
-		forward_local_addresses_changed();
+		nhrp_peer_cache_changed();
+		forward_local_address_add(peer);
 		break;
 	case NHRP_PEER_TYPE_LOCAL_ROUTE:
 		peer->flags |= NHRP_PEER_FLAG_UP;
+		nhrp_peer_cache_changed();
 		break;
 	case NHRP_PEER_TYPE_INCOMPLETE:
 		nhrp_peer_send_resolve(peer);
@@ -1611,7 +2029,7 @@ static void nhrp_peer_insert_cb(struct ev_timer *w, int revents)
 		break;
 	case NHRP_PEER_TYPE_SHORTCUT_ROUTE:
 		if (peer->flags & NHRP_PEER_FLAG_UP)
-			nhrp_peer_script_route_up_done(&peer->child, 0);
+			nhrp_peer_script_route_up_done(&peer->timer, 0);
 		else if (nhrp_peer_route(peer->interface,
 					 &peer->next_hop_address,
 					 NHRP_PEER_FIND_UP | NHRP_PEER_FIND_EXACT,
@@ -1621,7 +2039,8 @@ static void nhrp_peer_insert_cb(struct ev_timer *w, int revents)
 		else
 			nhrp_peer_schedule(
 				peer,
-				holding_time_to_expiry_time(peer->expire_time - ev_now(), 10),
+				nhrp_peer_jitter(peer, holding_time_to_expiry_time(
+					peer->expire_time - ev_now(), 10)),
 				nhrp_peer_expire_cb);
 		break;
 	case NHRP_PEER_TYPE_NEGATIVE:
@@ -1641,13 +2060,22 @@ static void nhrp_peer_insert_cb(struct ev_timer *w, int revents)
 
 static void nhrp_peer_reinsert(struct nhrp_peer *peer, int type)
 {
+	int reindex;
+
 	NHRP_BUG_ON((peer->type == NHRP_PEER_TYPE_LOCAL_ADDR) !=
 		    (type == NHRP_PEER_TYPE_LOCAL_ADDR));
 	NHRP_BUG_ON((peer->type == NHRP_PEER_TYPE_LOCAL_ROUTE) !=
 		    (type == NHRP_PEER_TYPE_LOCAL_ROUTE));
 
 	peer->flags &= ~NHRP_PEER_FLAG_REMOVED;
+	nhrp_peer_cache_changed();
+	/* The indexes depend on the type */
+	reindex = peer->type != type && peer->trie_node != NULL;
+	if (reindex)
+		nhrp_peer_unindex(peer);
 	peer->type = type;
+	if (reindex)
+		nhrp_peer_index(peer);
 	nhrp_peer_insert_cb(&peer->timer, 0);
 }
 
@@ -1713,6 +2141,8 @@ void nhrp_peer_insert(struct nhrp_peer *peer)
 		list_add(&peer->peer_list_entry, &local_peer_list);
 	else
 		list_add(&peer->peer_list_entry, &peer->interface->peer_list);
+	peer->cache_seq = ++nhrp_peer_cache_seq;
+	nhrp_peer_index(peer);
 
 	/* Start peers life */
 	if (nhrp_running || peer->type == NHRP_PEER_TYPE_LOCAL_ADDR)
@@ -1742,7 +2172,7 @@ void nhrp_peer_purge(struct nhrp_peer *peer, const char *purge_reason)
 			nhrp_peer_run_script(peer, "peer-down",
 					     nhrp_peer_script_peer_down_done);
 		} else {
-			nhrp_peer_script_peer_down_done(&peer->child, 0);
+			nhrp_peer_script_peer_down_done(&peer->timer, 0);
 		}
 		nhrp_address_set_type(&peer->my_nbma_address, PF_UNSPEC);
 		break;
@@ -1777,18 +2207,16 @@ int nhrp_peer_lowerdown_matching(void *ctx, struct nhrp_peer *peer)
 static void nhrp_peer_remove_cb(struct ev_timer *w, int revents)
 {
 	struct nhrp_peer *peer = container_of(w, struct nhrp_peer, timer);
-	int type;
 
 	peer->flags |= NHRP_PEER_FLAG_REMOVED;
 	peer->purge_reason = "expired";
 	nhrp_peer_is_down(peer);
 	list_del(&peer->peer_list_entry);
+	nhrp_peer_unindex(peer);
 
-	type = peer->type;
+	if (peer->type == NHRP_PEER_TYPE_LOCAL_ADDR)
+		forward_local_address_del(peer);
 	nhrp_peer_put(peer);
-
-	if (type == NHRP_PEER_TYPE_LOCAL_ADDR)
-		forward_local_addresses_changed();
 }
 
 void nhrp_peer_remove(struct nhrp_peer *peer)
@@ -1803,6 +2231,7 @@ void nhrp_peer_remove(struct nhrp_peer *peer)
 		   nhrp_peer_format(peer, sizeof(tmp), tmp));
 
 	peer->flags |= NHRP_PEER_FLAG_REMOVED;
+	nhrp_peer_cache_changed();
 	nhrp_peer_is_down(peer);
 	nhrp_peer_cancel_async(peer);
 	nhrp_peer_schedule(peer, 0, nhrp_peer_remove_cb);
@@ -1851,8 +2280,8 @@ int nhrp_peer_match(struct nhrp_peer *p, struct nhrp_peer_selector *sel)
 		return FALSE;
 
 	if (sel->hostname != NULL &&
-	    (p->nbma_hostname == NULL ||
-	     strcmp(sel->hostname, p->nbma_hostname) != 0))
+	    (nhrp_peer_hostname(p) == NULL ||
+	     strcmp(sel->hostname, nhrp_peer_hostname(p)) != 0))
 		return FALSE;
 
 	if (sel->parent != NULL &&
@@ -1917,13 +2346,188 @@ struct enum_interface_peers_ctx {
 	struct nhrp_peer_selector *sel;
 };
 
-static int enumerate_peer_cache(struct list_head *peer_cache,
+struct peer_candidates {
+	int num, size;
+	struct nhrp_peer **peer;
+	struct nhrp_peer *buf[16];
+};
+
+static void add_candidate(struct peer_candidates *pc, struct nhrp_peer *p)
+{
+	struct nhrp_peer **n;
+
+	if (pc->num >= pc->size) {
+		if (pc->peer == pc->buf) {
+			n = malloc(2 * pc->size * sizeof(*n));
+			memcpy(n, pc->buf, sizeof(pc->buf));
+		} else {
+			n = realloc(pc->peer, 2 * pc->size * sizeof(*n));
+		}
+		pc->peer = n;
+		pc->size *= 2;
+	}
+	pc->peer[pc->num++] = p;
+}
+
+static int collect_candidates(void *ctx, struct nhrp_trie_node *node)
+{
+	struct peer_candidates *pc = (struct peer_candidates *) ctx;
+	struct nhrp_peer *p;
+
+	list_for_each_entry(p, &node->entries, trie_list_entry)
+		add_candidate(pc, p);
+
+	return 0;
+}
+
+static int cmp_candidates(const void *a, const void *b)
+{
+	const struct nhrp_peer *pa = *(const struct nhrp_peer **) a;
+	const struct nhrp_peer *pb = *(const struct nhrp_peer **) b;
+
+	/* Newest first; the same order as on the peer list */
+	if (pa->cache_seq > pb->cache_seq)
+		return -1;
+	if (pa->cache_seq < pb->cache_seq)
+		return 1;
+	return 0;
+}
+
+static int enumerate_candidates(struct peer_candidates *pc,
 				nhrp_peer_enumerator e, void *ctx,
 				struct nhrp_peer_selector *sel)
 {
+	struct nhrp_peer *p;
+	int i, rc = 0;
+
+	if (pc->num > 1)
+		qsort(pc->peer, pc->num, sizeof(pc->peer[0]), cmp_candidates);
+
+	for (i = 0; i < pc->num; i++) {
+		p = pc->peer[i];
+		if (p->flags & NHRP_PEER_FLAG_REMOVED)
+			continue;
+
+		if (nhrp_peer_match(p, sel)) {
+			rc = e(ctx, p);
+			if (rc != 0)
+				break;
+		}
+	}
+
+	if (pc->peer != pc->buf)
+		free(pc->peer);
+
+	return rc;
+}
+
+static int enumerate_peer_hash(struct nhrp_hash *hash,
+			       nhrp_peer_enumerator e, void *ctx,
+			       struct nhrp_peer_selector *sel)
+{
+	struct peer_candidates pc;
+	struct nhrp_peer *p;
+	struct hlist_node *n;
+	unsigned int key;
+
+	pc.num = 0;
+	pc.size = ARRAY_SIZE(pc.buf);
+	pc.peer = pc.buf;
+
+	key = nhrp_hash_address(&sel->protocol_address);
+	nhrp_hash_for_each_entry(p, n, hash, key, protocol_hash_entry) {
+		if (nhrp_address_cmp(&p->protocol_address,
+				     &sel->protocol_address) == 0)
+			add_candidate(&pc, p);
+	}
+
+	return enumerate_candidates(&pc, e, ctx, sel);
+}
+
+static int enumerate_peer_nexthop(struct nhrp_hash *hash,
+				  nhrp_peer_enumerator e, void *ctx,
+				  struct nhrp_peer_selector *sel)
+{
+	struct peer_candidates pc;
+	struct nhrp_peer *p;
+	struct hlist_node *n;
+	unsigned int key;
+
+	pc.num = 0;
+	pc.size = ARRAY_SIZE(pc.buf);
+	pc.peer = pc.buf;
+
+	key = nhrp_hash_address(&sel->next_hop_address);
+	nhrp_hash_for_each_entry(p, n, hash, key, nexthop_hash_entry) {
+		if (nhrp_address_cmp(&p->next_hop_address,
+				     &sel->next_hop_address) == 0)
+			add_candidate(&pc, p);
+	}
+
+	return enumerate_candidates(&pc, e, ctx, sel);
+}
+
+static int enumerate_peer_trie(struct nhrp_trie *trie,
+			       nhrp_peer_enumerator e, void *ctx,
+			       struct nhrp_peer_selector *sel)
+{
+	struct peer_candidates pc;
+	int prefix, full;
+
+	pc.num = 0;
+	pc.size = ARRAY_SIZE(pc.buf);
+	pc.peer = pc.buf;
+
+	full = sel->protocol_address.addr_len * 8;
+	prefix = sel->prefix_length;
+	if (prefix == 0 || prefix > full)
+		prefix = full;
+
+	/* Only prefixes of the address can be routes or exact matches.
+	 * Subnet match needs the entries below the selector prefix,
+	 * or the covering entries for a host address. */
+	if ((sel->flags & (NHRP_PEER_FIND_EXACT | NHRP_PEER_FIND_ROUTE)) ||
+	    prefix == full)
+		nhrp_trie_foreach_path(trie, &sel->protocol_address, full,
+				       collect_candidates, &pc);
+	else
+		nhrp_trie_foreach_subtree(trie, &sel->protocol_address, prefix,
+					  collect_candidates, &pc);
+
+	return enumerate_candidates(&pc, e, ctx, sel);
+}
+
+static int enumerate_peer_cache(struct nhrp_interface *iface,
+				nhrp_peer_enumerator e, void *ctx,
+				struct nhrp_peer_selector *sel)
+{
+	struct list_head *peer_cache = &local_peer_list;
+	struct nhrp_trie *peer_trie = &local_peer_trie;
+	struct nhrp_hash *peer_hash = &local_peer_hash;
 	struct nhrp_peer *p;
 	int rc = 0;
 
+	/* NULL interface is the local address cache */
+	if (iface != NULL) {
+		peer_cache = &iface->peer_list;
+		peer_trie = &iface->peer_trie;
+		peer_hash = &iface->peer_hash;
+	}
+
+	if (sel != NULL && sel->protocol_address.type != PF_UNSPEC) {
+		/* Exact matches need identical protocol address */
+		if (sel->flags & NHRP_PEER_FIND_EXACT)
+			return enumerate_peer_hash(peer_hash, e, ctx, sel);
+		return enumerate_peer_trie(peer_trie, e, ctx, sel);
+	}
+
+	/* Shortcut routes are indexed by their next hop */
+	if (iface != NULL && sel != NULL &&
+	    sel->type_mask == BIT(NHRP_PEER_TYPE_SHORTCUT_ROUTE) &&
+	    sel->next_hop_address.type != PF_UNSPEC)
+		return enumerate_peer_nexthop(&iface->nexthop_hash,
+					      e, ctx, sel);
+
 	list_for_each_entry(p, peer_cache, peer_list_entry) {
 		if (p->flags & NHRP_PEER_FLAG_REMOVED)
 			continue;
@@ -1943,8 +2547,7 @@ static int enum_interface_peers(void *ctx, struct nhrp_interface *iface)
 	struct enum_interface_peers_ctx *ectx =
 		(struct enum_interface_peers_ctx *) ctx;
 
-	return enumerate_peer_cache(&iface->peer_list,
-				    ectx->enumerator, ectx->ctx,
+	return enumerate_peer_cache(iface, ectx->enumerator, ectx->ctx,
 				    ectx->sel);
 }
 
@@ -1958,12 +2561,15 @@ int nhrp_peer_foreach(nhrp_peer_enumerator e, void *ctx,
 	if (sel != NULL)
 		iface = sel->interface;
 
-	rc = enumerate_peer_cache(&local_peer_list, e, ctx, sel);
-	if (rc != 0)
-		return rc;
+	/* Speed optimization: local list holds only TYPE_LOCAL peers,
+	 * and they cannot be found from other places */
+	if (sel == NULL || sel->type_mask == 0 ||
+	    (sel->type_mask & BIT(NHRP_PEER_TYPE_LOCAL_ADDR))) {
+		rc = enumerate_peer_cache(NULL, e, ctx, sel);
+		if (rc != 0)
+			return rc;
+	}
 
-	/* Speed optimization: TYPE_LOCAL peers cannot be found from
-	 * other places */
 	if (sel != NULL &&
 	    sel->type_mask == BIT(NHRP_PEER_TYPE_LOCAL_ADDR))
 		return 0;
@@ -1971,7 +2577,7 @@ int nhrp_peer_foreach(nhrp_peer_enumerator e, void *ctx,
 	if (iface == NULL)
 		rc = nhrp_interface_foreach(enum_interface_peers, &ectx);
 	else
-		rc = enumerate_peer_cache(&iface->peer_list, e, ctx, sel);
+		rc = enumerate_peer_cache(iface, e, ctx, sel);
 
 	return rc;
 }
@@ -1981,7 +2587,7 @@ struct route_decision {
 	struct list_head *exclude;
 	struct nhrp_peer *best_found;
 	struct nhrp_address *src;
-	int found_exact, found_up;
+	int found_exact, found_up, tied;
 };
 
 static int decide_route(void *ctx, struct nhrp_peer *peer)
@@ -2026,9 +2632,13 @@ static int decide_route(void *ctx, struct nhrp_peer *peer)
 		if (rd->best_found->prefix_length > peer->prefix_length)
 			return 0;
 
-		if (rd->best_found->prefix_length == peer->prefix_length &&
-		    rd->best_found->last_used < peer->last_used)
-			return 0;
+		if (rd->best_found->prefix_length == peer->prefix_length) {
+			/* Least recently used wins; the result depends
+			 * on time and cannot be cached */
+			rd->tied = TRUE;
+			if (rd->best_found->last_used < peer->last_used)
+				return 0;
+		}
 	}
 
 	rd->best_found = peer;
@@ -2043,7 +2653,33 @@ struct nhrp_peer *nhrp_peer_route_full(struct nhrp_interface *interface,
 				       struct nhrp_address *src,
 				       struct list_head *exclude)
 {
+	struct route_cache_entry *rc = NULL;
 	struct route_decision rd;
+	unsigned int key;
+
+	/* Lookups carrying an exclude list are done for forwarded
+	 * packets and are not cached */
+	if (exclude == NULL) {
+		key = nhrp_hash_address(dst) ^ flags ^ type_mask ^
+			(unsigned int) (uintptr_t) interface;
+		if (src != NULL)
+			key ^= nhrp_hash_address(src) * 33;
+		rc = &route_cache[key % NHRP_ROUTE_CACHE_SIZE];
+
+		if (rc->generation == nhrp_peer_cache_generation &&
+		    rc->interface == interface &&
+		    rc->flags == flags &&
+		    rc->type_mask == type_mask &&
+		    nhrp_address_cmp(&rc->dst, dst) == 0 &&
+		    ((src == NULL && rc->src.type == PF_UNSPEC) ||
+		     (src != NULL && nhrp_address_cmp(&rc->src, src) == 0))) {
+			nhrp_peer_stats.route_cache_hits++;
+			if (rc->peer != NULL)
+				rc->peer->last_used = ev_now();
+			return rc->peer;
+		}
+		nhrp_peer_stats.route_cache_misses++;
+	}
 
 	memset(&rd, 0, sizeof(rd));
 	rd.sel.flags = flags & ~NHRP_PEER_FIND_UP;
@@ -2057,11 +2693,25 @@ struct nhrp_peer *nhrp_peer_route_full(struct nhrp_interface *interface,
 	rd.src = src;
 	nhrp_peer_foreach(decide_route, &rd, &rd.sel);
 
-	if (rd.best_found == NULL)
-		return NULL;
-
-	if ((flags & NHRP_PEER_FIND_UP) &&
+	if (rd.best_found != NULL &&
+	    (flags & NHRP_PEER_FIND_UP) &&
 	    !(rd.best_found->flags & NHRP_PEER_FLAG_UP))
+		rd.best_found = NULL;
+
+	if (rc != NULL && !rd.tied) {
+		rc->generation = nhrp_peer_cache_generation;
+		rc->interface = interface;
+		rc->peer = rd.best_found;
+		rc->flags = flags;
+		rc->type_mask = type_mask;
+		rc->dst = *dst;
+		if (src != NULL)
+			rc->src = *src;
+		else
+			nhrp_address_set_type(&rc->src, PF_UNSPEC);
+	}
+
+	if (rd.best_found == NULL)
 		return NULL;
 
 	rd.best_found->last_used = ev_now();
@@ -13,6 +13,11 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include "nhrp_address.h"
+#include "nhrp_common.h"
+#include "nhrp_trie.h"
+#include "nhrp_hash.h"
+#include "nhrp_script.h"
+#include "nhrp_wheel.h"
 #include "libev.h"
 #include "list.h"
 
@@ -71,6 +76,8 @@
 #define NHRP_PEER_FLAG_REPLACED		0x80	/* Peer has been replaced */
 #define NHRP_PEER_FLAG_REMOVED		0x100	/* Deleted, but not removed from cache yet */
 #define NHRP_PEER_FLAG_MARK		0x200	/* Can be used to temporarily mark peers */
+#define NHRP_PEER_FLAG_FILTERED		0x400	/* Local address in forwarding filter */
+#define NHRP_PEER_FLAG_KERNEL		0x800	/* Local entry learned via netlink */
 
 #define NHRP_PEER_FIND_ROUTE		0x01
 #define NHRP_PEER_FIND_EXACT		0x02
@@ -87,39 +94,59 @@ union __attribute__ ((__transparent_union__)) nhrp_peer_event {
 	struct ev_child *child;
 };
 
+/* Rarely used state, allocated on first use by nhrp_peer_cold() */
+struct nhrp_peer_cold {
+	struct nhrp_peer *peer;
+	struct nhrp_script script;
+	struct nhrp_address_query address_query;
+	struct kernel_route_query route_query;
+	struct nhrp_packet *queued_packet;
+	char *nbma_hostname;
+	struct nhrp_address next_hop_nat_oa;
+	/* NBMA address of the kernel multicast replica, if any */
+	struct nhrp_address mcast_nbma;
+
+	/* Round trip estimate for requests sent via this peer,
+	 * and consecutive failures for the retry back-off */
+	ev_tstamp srtt, rttvar;
+	unsigned int retries;
+};
+
 struct nhrp_peer {
-	unsigned int ref;
+	/* Everything nhrp_peer_match() looks at fits in the first
+	 * cache line; peers are allocated cache line aligned */
 	unsigned int flags;
+	uint8_t type;
+	uint8_t prefix_length;
+	uint16_t afnum;
+	struct nhrp_interface *interface;
+	struct nhrp_address protocol_address;
+	/* NHRP_PEER_TYPE_ROUTE: protocol addr., others: NBMA addr. */
+	struct nhrp_address next_hop_address;
+	unsigned int ref;
+	struct nhrp_peer *parent;
+	struct nhrp_peer_cold *cold;
+	unsigned long cache_seq;
 
 	struct list_head peer_list_entry;
 	struct list_head mcast_list_entry;
-	struct hlist_node nbma_hash_entry;
+	struct nhrp_hash_node nbma_hash_entry;
+	struct list_head trie_list_entry;
+	struct nhrp_trie_node *trie_node;
+	struct nhrp_hash_node protocol_hash_entry;
+	struct nhrp_hash_node nexthop_hash_entry;
 
 	const char *purge_reason;
-	struct nhrp_interface *interface;
-	struct nhrp_peer *parent;
-	struct nhrp_packet *queued_packet;
 	struct nhrp_pending_request *request;
-
 	struct ev_timer timer;
-	struct ev_child child;
-	struct nhrp_address_query address_query;
+	struct nhrp_wheel_timer wheel_timer;
 
-	uint8_t type;
-	uint8_t prefix_length;
-	uint16_t afnum;
 	uint16_t protocol_type;
 	uint16_t mtu, my_nbma_mtu;
+	unsigned int holding_time;
 	ev_tstamp expire_time;
 	ev_tstamp last_used;
 	struct nhrp_address my_nbma_address;
-	struct nhrp_address protocol_address;
-	unsigned int holding_time;
-
-	char *nbma_hostname;
-	/* NHRP_PEER_TYPE_ROUTE: protocol addr., others: NBMA addr. */
-	struct nhrp_address next_hop_address;
-	struct nhrp_address next_hop_nat_oa;
 };
 
 struct nhrp_peer_selector {
@@ -137,7 +164,15 @@ struct nhrp_peer_selector {
 	struct nhrp_address local_nbma_address;
 };
 
+struct nhrp_peer_stats {
+	unsigned long route_cache_hits;
+	unsigned long route_cache_misses;
+	unsigned long peer_slabs;
+	unsigned long peer_slab_bytes;
+};
+
 extern const char * const nhrp_peer_type[NHRP_PEER_TYPE_MAX];
+extern struct nhrp_peer_stats nhrp_peer_stats;
 typedef int (*nhrp_peer_enumerator)(void *ctx, struct nhrp_peer *peer);
 
 void nhrp_peer_cleanup(void);
@@ -146,6 +181,24 @@ struct nhrp_peer *nhrp_peer_alloc(struct nhrp_interface *iface);
 struct nhrp_peer *nhrp_peer_get(struct nhrp_peer *peer);
 int nhrp_peer_put(struct nhrp_peer *peer);
 void nhrp_peer_cancel_async(struct nhrp_peer *peer);
+struct nhrp_peer_cold *nhrp_peer_cold(struct nhrp_peer *peer);
+size_t nhrp_peer_object_size(void);
+
+static inline const char *nhrp_peer_hostname(struct nhrp_peer *peer)
+{
+	if (peer->cold == NULL)
+		return NULL;
+	return peer->cold->nbma_hostname;
+}
+
+/* NAT original address, only known for peers behind NAT */
+static inline struct nhrp_address *nhrp_peer_nat_oa(struct nhrp_peer *peer)
+{
+	if (peer->cold == NULL ||
+	    peer->cold->next_hop_nat_oa.type == PF_UNSPEC)
+		return NULL;
+	return &peer->cold->next_hop_nat_oa;
+}
 
 void nhrp_peer_insert(struct nhrp_peer *peer);
 void nhrp_peer_remove(struct nhrp_peer *peer);
@@ -0,0 +1,560 @@
+/* nhrp_script.c - Event script execution
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "nhrp_defines.h"
+#include "nhrp_common.h"
+#include "nhrp_script.h"
+#include "list.h"
+
+/* Records sent to the workers are the action followed by the
+ * environment, each NUL terminated */
+#define NHRP_SCRIPT_RECORD_SIZE		(64 + NHRP_SCRIPT_ENV_SIZE)
+
+/* Sent to a busy worker to interrupt its script; idle workers
+ * ignore it, as the script may have exited meanwhile */
+#define NHRP_SCRIPT_CANCEL		'C'
+
+struct nhrp_script_job {
+	struct list_head queue_entry;
+	struct nhrp_script *script;
+	struct ev_child child;
+	ev_tstamp queued;
+	int running;
+	size_t len;
+	char record[];
+};
+
+/* Workers are forked once at startup and spawn the actual scripts,
+ * so the daemon itself never forks per event. */
+struct nhrp_script_worker {
+	pid_t pid;
+	struct ev_io io;
+	struct nhrp_script_job *job;
+};
+
+int nhrp_script_workers = 0;
+int nhrp_script_max_parallel = 32;
+struct nhrp_script_stats nhrp_script_stats;
+
+static struct nhrp_script_worker *workers;
+static int num_workers;
+static int dispatching;
+static struct list_head script_queue[NHRP_SCRIPT_NUM_PRIOS] = {
+	LIST_INITIALIZER(script_queue[0]),
+	LIST_INITIALIZER(script_queue[1]),
+	LIST_INITIALIZER(script_queue[2]),
+};
+static struct list_head script_running = LIST_INITIALIZER(script_running);
+
+void nhrp_script_env_init(struct nhrp_script_env *env)
+{
+	env->num = 0;
+	env->len = 0;
+	env->envp[0] = NULL;
+}
+
+void nhrp_script_env_add(struct nhrp_script_env *env, const char *key,
+			 const char *value)
+{
+	size_t room = sizeof(env->buf) - env->len;
+	int n;
+
+	if (env->num >= NHRP_SCRIPT_MAX_ENV)
+		goto full;
+
+	n = snprintf(&env->buf[env->len], room, "%s=%s", key, value);
+	if (n < 0 || n >= room)
+		goto full;
+
+	env->envp[env->num++] = &env->buf[env->len];
+	env->envp[env->num] = NULL;
+	env->len += n + 1;
+	return;
+
+full:
+	nhrp_error("Script environment full, dropping %s", key);
+}
+
+void nhrp_script_env_addu32(struct nhrp_script_env *env, const char *key,
+			    uint32_t value)
+{
+	char tmp[16];
+
+	sprintf(tmp, "%u", value);
+	nhrp_script_env_add(env, key, tmp);
+}
+
+static int nhrp_script_parse_record(char *record, size_t len,
+				    char **action, char **envp)
+{
+	char *p = record, *end = record + len;
+	int num = 0;
+
+	if (len == 0 || end[-1] != 0)
+		return FALSE;
+
+	*action = p;
+	p += strlen(p) + 1;
+	while (p < end && num < NHRP_SCRIPT_MAX_ENV) {
+		envp[num++] = p;
+		p += strlen(p) + 1;
+	}
+	envp[num] = NULL;
+
+	return TRUE;
+}
+
+/* posix_spawn() uses vfork semantics, so launching a script does not
+ * copy the page tables of the whole daemon like fork() would. Each
+ * script gets its own process group so it can be interrupted with
+ * everything it started. */
+static pid_t nhrp_script_spawn(const char *action, char **envp)
+{
+	const char *argv[] = { nhrp_script_file, action, NULL };
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid;
+	int err;
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr,
+				 POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+				 POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigfillset(&mask);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+
+	err = posix_spawn(&pid, nhrp_script_file, NULL, &attr,
+			  (char **) argv, envp);
+	posix_spawnattr_destroy(&attr);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return pid;
+}
+
+static void nhrp_script_worker_sigchld(int sig)
+{
+}
+
+static int nhrp_script_worker_wait(int fd, pid_t pid)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int status = W_EXITCODE(127, 0);
+	sigset_t mask;
+	ssize_t len;
+	char cmd;
+
+	/* SIGCHLD is blocked except inside ppoll(), so an exit between
+	 * waitpid() and ppoll() still wakes us up */
+	sigemptyset(&mask);
+	while (waitpid(pid, &status, WNOHANG) == 0) {
+		if (ppoll(&pfd, 1, NULL, &mask) <= 0)
+			continue;
+		len = recv(fd, &cmd, sizeof(cmd), MSG_DONTWAIT);
+		if (len == 1) {
+			if (cmd == NHRP_SCRIPT_CANCEL)
+				kill(-pid, SIGINT);
+		} else if (len == 0 ||
+			   (len < 0 && errno != EAGAIN && errno != EINTR)) {
+			/* Daemon is gone, just wait for the script */
+			pfd.fd = -1;
+		}
+	}
+
+	return status;
+}
+
+static void nhrp_script_worker_main(int fd)
+{
+	char record[NHRP_SCRIPT_RECORD_SIZE];
+	char *envp[NHRP_SCRIPT_MAX_ENV + 1];
+	sigset_t mask;
+	char *action;
+	int status, i;
+	ssize_t len;
+	pid_t pid;
+
+	/* Drop everything inherited from the daemon */
+	for (i = 0; i < NSIG; i++)
+		signal(i, SIG_DFL);
+	signal(SIGCHLD, nhrp_script_worker_sigchld);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	for (i = 3; i < 1024; i++)
+		if (i != fd)
+			close(i);
+
+	for (;;) {
+		len = recv(fd, record, sizeof(record), 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			_exit(0);
+		if (len == 1 && record[0] == NHRP_SCRIPT_CANCEL)
+			continue;
+
+		status = W_EXITCODE(127, 0);
+		if (nhrp_script_parse_record(record, len, &action, envp)) {
+			pid = nhrp_script_spawn(action, envp);
+			if (pid > 0)
+				status = nhrp_script_worker_wait(fd, pid);
+		}
+
+		if (send(fd, &status, sizeof(status), 0) < 0)
+			_exit(0);
+	}
+}
+
+static void nhrp_script_dispatch(void);
+
+static void nhrp_script_complete(struct nhrp_script_job *job, int status)
+{
+	struct nhrp_script *script = job->script;
+
+	if (job->running) {
+		list_del(&job->queue_entry);
+		nhrp_script_stats.running--;
+	}
+	free(job);
+
+	if (script != NULL) {
+		script->job = NULL;
+		script->child.rpid = 0;
+		script->child.rstatus = status;
+		ev_cb(&script->child)(&script->child, EV_CHILD);
+	}
+
+	nhrp_script_dispatch();
+}
+
+static void nhrp_script_child_cb(struct ev_child *w, int revents)
+{
+	struct nhrp_script_job *job =
+		container_of(w, struct nhrp_script_job, child);
+
+	ev_child_stop(w);
+	nhrp_script_complete(job, w->rstatus);
+}
+
+static struct nhrp_script_worker *nhrp_script_idle_worker(void)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		if (workers[i].job == NULL && workers[i].pid > 0)
+			return &workers[i];
+	}
+	return NULL;
+}
+
+static struct nhrp_script_job *nhrp_script_dequeue(void)
+{
+	struct nhrp_script_job *job;
+	int i;
+
+	for (i = 0; i < NHRP_SCRIPT_NUM_PRIOS; i++) {
+		if (list_empty(&script_queue[i]))
+			continue;
+
+		job = list_next(&script_queue[i], struct nhrp_script_job,
+				queue_entry);
+		list_del(&job->queue_entry);
+		nhrp_script_stats.queued--;
+		return job;
+	}
+	return NULL;
+}
+
+static void nhrp_script_start(struct nhrp_script_job *job,
+			      struct nhrp_script_worker *w)
+{
+	char *envp[NHRP_SCRIPT_MAX_ENV + 1];
+	char *action;
+	ev_tstamp wait;
+	pid_t pid;
+
+	wait = ev_now() - job->queued;
+	nhrp_script_stats.started++;
+	nhrp_script_stats.wait_total += wait;
+	if (wait > nhrp_script_stats.wait_max)
+		nhrp_script_stats.wait_max = wait;
+
+	job->running = TRUE;
+	list_add_tail(&job->queue_entry, &script_running);
+	nhrp_script_stats.running++;
+
+	if (job->script != NULL && job->script->timeout != NULL)
+		ev_timer_again(job->script->timeout);
+
+	if (w != NULL) {
+		if (send(w->io.fd, job->record, job->len, 0) < 0) {
+			nhrp_perror("Unable to pass script to worker");
+			nhrp_script_complete(job, W_EXITCODE(127, 0));
+			return;
+		}
+		w->job = job;
+		return;
+	}
+
+	pid = -1;
+	if (nhrp_script_parse_record(job->record, job->len, &action, envp))
+		pid = nhrp_script_spawn(action, envp);
+	if (pid < 0) {
+		nhrp_perror("Unable to run script");
+		nhrp_script_complete(job, W_EXITCODE(127, 0));
+		return;
+	}
+
+	ev_child_set(&job->child, pid, 0);
+	ev_child_start(&job->child);
+}
+
+static void nhrp_script_dispatch(void)
+{
+	struct nhrp_script_worker *w = NULL;
+	struct nhrp_script_job *job;
+
+	/* Completions of failed starts call back here */
+	if (dispatching)
+		return;
+	dispatching = TRUE;
+
+	while (nhrp_script_stats.queued != 0) {
+		if (nhrp_script_max_parallel > 0 &&
+		    nhrp_script_stats.running >= nhrp_script_max_parallel)
+			break;
+		if (num_workers != 0) {
+			w = nhrp_script_idle_worker();
+			if (w == NULL)
+				break;
+		}
+
+		job = nhrp_script_dequeue();
+		nhrp_script_start(job, w);
+	}
+
+	dispatching = FALSE;
+}
+
+static void nhrp_script_worker_stop(struct nhrp_script_worker *w)
+{
+	ev_io_stop(&w->io);
+	close(w->io.fd);
+	w->pid = 0;
+}
+
+static int nhrp_script_worker_start(struct nhrp_script_worker *w);
+
+static void nhrp_script_worker_cb(struct ev_io *io, int revents)
+{
+	struct nhrp_script_worker *w =
+		container_of(io, struct nhrp_script_worker, io);
+	struct nhrp_script_job *job;
+	int status;
+	ssize_t len;
+
+	len = recv(io->fd, &status, sizeof(status), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	job = w->job;
+	w->job = NULL;
+	if (len != sizeof(status)) {
+		nhrp_error("Script worker %d died", w->pid);
+		nhrp_script_worker_stop(w);
+		nhrp_script_worker_start(w);
+		status = W_EXITCODE(127, 0);
+	}
+
+	if (job != NULL)
+		nhrp_script_complete(job, status);
+	else
+		nhrp_script_dispatch();
+}
+
+static int nhrp_script_worker_start(struct nhrp_script_worker *w)
+{
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		nhrp_perror("Unable to create script worker socket");
+		return FALSE;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		nhrp_perror("Unable to fork script worker");
+		close(sv[0]);
+		close(sv[1]);
+		return FALSE;
+	}
+	if (pid == 0)
+		nhrp_script_worker_main(sv[1]);
+
+	close(sv[1]);
+	w->pid = pid;
+	w->job = NULL;
+	ev_io_init(&w->io, nhrp_script_worker_cb, sv[0], EV_READ);
+	ev_io_start(&w->io);
+
+	return TRUE;
+}
+
+int nhrp_script_run(struct nhrp_script *script, const char *action,
+		    struct nhrp_script_env *env, int priority)
+{
+	struct nhrp_script_job *job;
+	size_t alen = strlen(action) + 1;
+
+	if (script != NULL)
+		nhrp_script_cancel(script);
+
+	job = malloc(sizeof(struct nhrp_script_job) + alen + env->len);
+	if (job == NULL)
+		return FALSE;
+
+	job->script = script;
+	job->queued = ev_now();
+	job->running = FALSE;
+	ev_child_init(&job->child, nhrp_script_child_cb, 0, 0);
+	job->len = alen + env->len;
+	memcpy(job->record, action, alen);
+	memcpy(&job->record[alen], env->buf, env->len);
+	if (script != NULL)
+		script->job = job;
+
+	list_add_tail(&job->queue_entry, &script_queue[priority]);
+	if (++nhrp_script_stats.queued > nhrp_script_stats.queue_peak)
+		nhrp_script_stats.queue_peak = nhrp_script_stats.queued;
+	nhrp_script_dispatch();
+
+	return TRUE;
+}
+
+static void nhrp_script_interrupt(struct nhrp_script_job *job)
+{
+	char cmd = NHRP_SCRIPT_CANCEL;
+	int i;
+
+	if (ev_is_active(&job->child)) {
+		kill(-job->child.pid, SIGINT);
+		return;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		if (workers[i].job != job)
+			continue;
+		if (send(workers[i].io.fd, &cmd, sizeof(cmd), 0) < 0)
+			nhrp_perror("Unable to cancel script in worker");
+		return;
+	}
+}
+
+void nhrp_script_cancel(struct nhrp_script *script)
+{
+	struct nhrp_script_job *job = script->job;
+
+	if (job == NULL)
+		return;
+
+	/* Running jobs hold their slot until the script exits, only the
+	 * completion is dropped. The script is interrupted so a hung
+	 * script does not keep the slot or the worker. */
+	script->job = NULL;
+	job->script = NULL;
+	if (job->running) {
+		nhrp_script_interrupt(job);
+	} else {
+		list_del(&job->queue_entry);
+		nhrp_script_stats.queued--;
+		free(job);
+	}
+}
+
+int nhrp_script_init(void)
+{
+	int i;
+
+	if (nhrp_script_workers <= 0)
+		return TRUE;
+
+	workers = calloc(nhrp_script_workers,
+			 sizeof(struct nhrp_script_worker));
+	if (workers == NULL)
+		return FALSE;
+
+	for (i = 0; i < nhrp_script_workers; i++) {
+		if (!nhrp_script_worker_start(&workers[i]))
+			break;
+	}
+	num_workers = i;
+	nhrp_info("Started %d script workers", num_workers);
+
+	return num_workers > 0;
+}
+
+void nhrp_script_cleanup(void)
+{
+	struct nhrp_script_job *job;
+	char *envp[NHRP_SCRIPT_MAX_ENV + 1];
+	char *action;
+	int i;
+
+	/* The event loop is gone; run scripts queued during shutdown
+	 * directly. Nobody waits for their completion anymore. */
+	while ((job = nhrp_script_dequeue()) != NULL) {
+		if (job->script != NULL)
+			job->script->job = NULL;
+		if (nhrp_script_parse_record(job->record, job->len,
+					     &action, envp))
+			nhrp_script_spawn(action, envp);
+		free(job);
+	}
+
+	while (!list_empty(&script_running)) {
+		job = list_next(&script_running, struct nhrp_script_job,
+				queue_entry);
+		list_del(&job->queue_entry);
+		if (job->script != NULL)
+			job->script->job = NULL;
+		ev_child_stop(&job->child);
+		free(job);
+	}
+	nhrp_script_stats.running = 0;
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].job = NULL;
+		if (workers[i].pid > 0)
+			nhrp_script_worker_stop(&workers[i]);
+	}
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+}
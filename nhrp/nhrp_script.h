@@ -0,0 +1,74 @@
+/* nhrp_script.h - Event script execution
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#ifndef NHRP_SCRIPT_H
+#define NHRP_SCRIPT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libev.h"
+
+#define NHRP_SCRIPT_MAX_ENV		16
+#define NHRP_SCRIPT_ENV_SIZE		1024
+
+struct nhrp_script_job;
+
+/* Scripts waiting for a free slot are started in priority order */
+enum nhrp_script_priority {
+	NHRP_SCRIPT_PRIO_HIGH = 0,
+	NHRP_SCRIPT_PRIO_NORMAL,
+	NHRP_SCRIPT_PRIO_LOW,
+	NHRP_SCRIPT_NUM_PRIOS
+};
+
+/* Script environment, built in one buffer so it can be handed to
+ * execve() or a script worker as is */
+struct nhrp_script_env {
+	int num;
+	size_t len;
+	char *envp[NHRP_SCRIPT_MAX_ENV + 1];
+	char buf[NHRP_SCRIPT_ENV_SIZE];
+};
+
+/* Completion is reported through the child watcher callback with
+ * EV_CHILD and the exit status in rstatus, whether the script was
+ * forked directly or run by a worker. The optional timeout timer is
+ * (re)started only when the script leaves the queue. */
+struct nhrp_script {
+	struct ev_child child;
+	struct ev_timer *timeout;
+	struct nhrp_script_job *job;
+};
+
+struct nhrp_script_stats {
+	unsigned long started;
+	unsigned long running;
+	unsigned long queued;
+	unsigned long queue_peak;
+	ev_tstamp wait_total;
+	ev_tstamp wait_max;
+};
+
+extern int nhrp_script_workers;
+extern int nhrp_script_max_parallel;
+extern struct nhrp_script_stats nhrp_script_stats;
+
+void nhrp_script_env_init(struct nhrp_script_env *env);
+void nhrp_script_env_add(struct nhrp_script_env *env, const char *key,
+			 const char *value);
+void nhrp_script_env_addu32(struct nhrp_script_env *env, const char *key,
+			    uint32_t value);
+
+int nhrp_script_run(struct nhrp_script *script, const char *action,
+		    struct nhrp_script_env *env, int priority);
+void nhrp_script_cancel(struct nhrp_script *script);
+
+int nhrp_script_init(void);
+void nhrp_script_cleanup(void);
+
+#endif
@@ -13,12 +13,15 @@
 #include "nhrp_packet.h"
 #include "nhrp_interface.h"
 #include "nhrp_peer.h"
+#include "nhrp_hash.h"
 
-#define NHRP_MAX_PENDING_REQUESTS 16
+#define NHRP_MAX_PENDING_REQUESTS 1024
+#define NHRP_MAX_REGISTRATION_BACKOFF 300
 
 struct nhrp_pending_request {
-	struct list_head request_list_entry;
+	struct nhrp_hash_node request_hash_entry;
 	int natted;
+	int backoff;
 	int num_ok, num_error;
 	struct nhrp_packet *packet;
 	struct nhrp_cie *cie;
@@ -27,21 +30,39 @@ struct nhrp_pending_request {
 	ev_tstamp now;
 };
 
-static struct list_head request_list = LIST_INITIALIZER(request_list);
-static int num_pending_requests = 0;
+/* Requests being processed, hashed by the source NBMA and protocol
+ * addresses and the destination protocol address */
+static struct nhrp_hash request_hash;
+
+/* Registration admission: accepted registrations are spaced 1/rate
+ * seconds apart with up to one second worth of burst. Deferred ones
+ * are handed out distinct retry slots after that. */
+int server_registration_rate = 0;
+struct server_stats server_stats;
+static ev_tstamp admit_next, backoff_next;
 
 static void nhrp_server_start_cie_reg(struct nhrp_pending_request *pr);
 
+static unsigned int nhrp_server_request_hash(struct nhrp_packet *packet)
+{
+	unsigned int hash;
+
+	hash = nhrp_hash_address(&packet->src_nbma_address);
+	hash = nhrp_hash_bytes(packet->src_protocol_address.addr,
+			       packet->src_protocol_address.addr_len, hash);
+	return nhrp_hash_bytes(packet->dst_protocol_address.addr,
+			       packet->dst_protocol_address.addr_len, hash);
+}
+
 static struct nhrp_pending_request *
 nhrp_server_record_request(struct nhrp_packet *packet)
 {
 	struct nhrp_pending_request *pr;
 
 	pr = calloc(1, sizeof(struct nhrp_pending_request));
-	list_init(&pr->request_list_entry);
 	if (pr != NULL) {
-		num_pending_requests++;
-		list_add(&pr->request_list_entry, &request_list);
+		nhrp_hash_add(&request_hash, &pr->request_hash_entry,
+			      nhrp_server_request_hash(packet));
 		pr->packet = nhrp_packet_get(packet);
 		pr->now = ev_now();
 	}
@@ -50,7 +71,7 @@ nhrp_server_record_request(struct nhrp_packet *packet)
 
 void nhrp_server_finish_request(struct nhrp_pending_request *pr)
 {
-	list_del(&pr->request_list_entry);
+	nhrp_hash_del(&request_hash, &pr->request_hash_entry);
 	if (pr->rpeer != NULL) {
 		struct nhrp_peer *peer = pr->rpeer;
 		if (peer->flags & NHRP_PEER_FLAG_REPLACED) {
@@ -67,14 +88,16 @@ void nhrp_server_finish_request(struct nhrp_pending_request *pr)
 	if (pr->packet != NULL)
 		nhrp_packet_put(pr->packet);
 	free(pr);
-	num_pending_requests--;
 }
 
 static int nhrp_server_request_pending(struct nhrp_packet *packet)
 {
 	struct nhrp_pending_request *r;
+	struct hlist_node *n;
+	unsigned int hash = nhrp_server_request_hash(packet);
 
-	list_for_each_entry(r, &request_list, request_list_entry) {
+	nhrp_hash_for_each_entry(r, n, &request_hash, hash,
+				 request_hash_entry) {
 		if (nhrp_address_cmp(&packet->src_nbma_address,
 				     &r->packet->src_nbma_address) != 0)
 			continue;
@@ -256,6 +279,11 @@ static void nhrp_server_finish_cie_reg_cb(union nhrp_peer_event e, int revents)
 		pr->num_ok++;
 		cie->hdr.code = NHRP_CODE_SUCCESS;
 		nhrp_peer_insert(peer);
+	} else if (pr->backoff != 0) {
+		nhrp_debug("[%s] Peer registration deferred", tmp);
+		pr->num_error++;
+		cie->hdr.code = NHRP_CODE_INSUFFICIENT_RESOURCES;
+		cie->hdr.holding_time = htons(pr->backoff);
 	} else {
 		if (revents == 0)
 			nhrp_error("[%s] Peer registration failed: "
@@ -319,7 +347,7 @@ static void nhrp_server_start_cie_reg(struct nhrp_pending_request *pr)
 		peer->next_hop_address = packet->src_nbma_address;
 
 	if (pr->natted) {
-		peer->next_hop_nat_oa  = peer->next_hop_address;
+		nhrp_peer_cold(peer)->next_hop_nat_oa = peer->next_hop_address;
 		peer->next_hop_address = packet->src_linklayer_address;
 	}
 
@@ -344,23 +372,52 @@ static void nhrp_server_start_cie_reg(struct nhrp_pending_request *pr)
 	peer->request = pr;
 
 	/* Check that there is no conflicting peers */
-	if (nhrp_peer_foreach(find_one, peer, &sel) != 0) {
+	if (pr->backoff != 0) {
+		peer->flags |= NHRP_PEER_FLAG_REPLACED;
+		nhrp_server_finish_cie_reg_cb(&peer->timer, 0);
+	} else if (nhrp_peer_foreach(find_one, peer, &sel) != 0) {
 		cie->hdr.code = NHRP_CODE_ADMINISTRATIVELY_PROHIBITED;
 		peer->flags |= NHRP_PEER_FLAG_REPLACED;
-		nhrp_server_finish_cie_reg_cb(&peer->child, 0);
+		nhrp_server_finish_cie_reg_cb(&peer->timer, 0);
 	} else {
 		nhrp_peer_run_script(peer, "peer-register",
 				     nhrp_server_finish_cie_reg_cb);
 	}
 }
 
+static int nhrp_server_admit_registration(void)
+{
+	ev_tstamp now = ev_now(), slot;
+
+	if (admit_next < now)
+		admit_next = now;
+	if (request_hash.count < NHRP_MAX_PENDING_REQUESTS &&
+	    (server_registration_rate == 0 || admit_next - now < 1.0)) {
+		if (server_registration_rate != 0)
+			admit_next += 1.0 / server_registration_rate;
+		server_stats.registrations_admitted++;
+		return 0;
+	}
+
+	slot = backoff_next;
+	if (slot < admit_next)
+		slot = admit_next;
+	if (slot - now > NHRP_MAX_REGISTRATION_BACKOFF)
+		slot = now + NHRP_MAX_REGISTRATION_BACKOFF;
+	backoff_next = slot + (server_registration_rate ?
+			       1.0 / server_registration_rate : 1.0);
+	server_stats.registrations_deferred++;
+
+	return (int) (slot - now) + 1;
+}
+
 static int nhrp_handle_registration_request(struct nhrp_packet *packet)
 {
 	char tmp[64], tmp2[64];
 	struct nhrp_payload *payload;
 	struct nhrp_cie *cie;
 	struct nhrp_pending_request *pr;
-	int natted = 0;
+	int natted = 0, backoff;
 
 	nhrp_info("Received Registration Request from proto src %s to %s",
 		  nhrp_address_format(&packet->src_protocol_address,
@@ -373,15 +430,6 @@ static int nhrp_handle_registration_request(struct nhrp_packet *packet)
 		return TRUE;
 	}
 
-	if (num_pending_requests >= NHRP_MAX_PENDING_REQUESTS) {
-		/* We should probably send Registration Reply with CIE
-		 * error NHRP_CODE_INSUFFICIENT_RESOURCES, or an Error
-		 * Indication. However, we do not have a direct peer entry
-		 * nor can we make sure that the lower layer is up, so
-		 * we just lamely drop the packet for now. */
-		nhrp_info("Too many pending requests: dropping this one");
-		return TRUE;
-	}
 
 	/* Cisco NAT extension, CIE added IF all of the following is true:
 	 * 1. We are the first hop registration server
@@ -422,9 +470,18 @@ static int nhrp_handle_registration_request(struct nhrp_packet *packet)
 		return TRUE;
 	}
 
+	/* Over the admission rate or pending request limit the
+	 * CIEs are answered with insufficient resources, and the
+	 * holding time tells when to try again */
+	backoff = nhrp_server_admit_registration();
+	if (backoff != 0)
+		nhrp_info("Too many registrations: retry in %d seconds",
+			  backoff);
+
 	/* Start processing the CIEs */
 	pr = nhrp_server_record_request(packet);
 	pr->natted = natted;
+	pr->backoff = backoff;
 	pr->payload = payload;
 
 	pr->cie = nhrp_payload_get_cie(payload, 1);
@@ -0,0 +1,215 @@
+/* nhrp_trie.c - Longest prefix match trie for protocol addresses
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "nhrp_trie.h"
+
+/* Path compressed binary trie. Every node holds a prefix; nodes with
+ * an empty entry list are glue nodes and exist only as long as they
+ * have two children. */
+
+static int trie_key(uint8_t *key, const struct nhrp_address *addr, int prefix)
+{
+	memset(key, 0, NHRP_TRIE_KEY_LEN);
+	key[0] = addr->type >> 8;
+	key[1] = addr->type & 0xff;
+	memcpy(&key[2], addr->addr, addr->addr_len);
+
+	if (prefix < 0 || prefix > addr->addr_len * 8)
+		prefix = addr->addr_len * 8;
+
+	return 16 + prefix;
+}
+
+static inline int trie_bit(const uint8_t *key, int bit)
+{
+	return (key[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+static int trie_common_bits(const uint8_t *a, const uint8_t *b, int max)
+{
+	int i, bits;
+	uint8_t d;
+
+	for (i = 0, bits = 0; bits < max; i++, bits += 8) {
+		d = a[i] ^ b[i];
+		if (d == 0)
+			continue;
+		while (!(d & 0x80)) {
+			d <<= 1;
+			bits++;
+		}
+		break;
+	}
+
+	return bits < max ? bits : max;
+}
+
+static struct nhrp_trie_node *trie_node_alloc(const uint8_t *key, int bits,
+					      struct nhrp_trie_node *parent)
+{
+	struct nhrp_trie_node *n;
+
+	n = calloc(1, sizeof(struct nhrp_trie_node));
+	memcpy(n->key, key, sizeof(n->key));
+	n->bits = bits;
+	n->parent = parent;
+	list_init(&n->entries);
+
+	return n;
+}
+
+static struct nhrp_trie_node **trie_link(struct nhrp_trie *trie,
+					 struct nhrp_trie_node *n)
+{
+	if (n->parent == NULL)
+		return &trie->root;
+	if (n->parent->child[0] == n)
+		return &n->parent->child[0];
+	return &n->parent->child[1];
+}
+
+struct nhrp_trie_node *nhrp_trie_get(struct nhrp_trie *trie,
+				     const struct nhrp_address *addr,
+				     int prefix)
+{
+	struct nhrp_trie_node **link = &trie->root, *parent = NULL;
+	struct nhrp_trie_node *n, *leaf, *glue;
+	uint8_t key[NHRP_TRIE_KEY_LEN];
+	int bits, common = 0;
+
+	bits = trie_key(key, addr, prefix);
+	while ((n = *link) != NULL) {
+		common = trie_common_bits(n->key, key,
+					  n->bits < bits ? n->bits : bits);
+		if (common < n->bits)
+			break;
+		if (n->bits == bits)
+			return n;
+		parent = n;
+		link = &n->child[trie_bit(key, n->bits)];
+	}
+
+	leaf = trie_node_alloc(key, bits, parent);
+	if (n == NULL) {
+		*link = leaf;
+		return leaf;
+	}
+
+	if (common == bits) {
+		/* New prefix covers the existing node */
+		leaf->child[trie_bit(n->key, bits)] = n;
+		n->parent = leaf;
+		*link = leaf;
+		return leaf;
+	}
+
+	/* Split at the first differing bit */
+	glue = trie_node_alloc(key, common, parent);
+	glue->child[trie_bit(key, common)] = leaf;
+	glue->child[trie_bit(n->key, common)] = n;
+	leaf->parent = glue;
+	n->parent = glue;
+	*link = glue;
+
+	return leaf;
+}
+
+void nhrp_trie_put(struct nhrp_trie *trie, struct nhrp_trie_node *n)
+{
+	struct nhrp_trie_node *child, *parent;
+
+	while (n != NULL && list_empty(&n->entries)) {
+		if (n->child[0] != NULL && n->child[1] != NULL)
+			break;
+
+		child = n->child[0] != NULL ? n->child[0] : n->child[1];
+		parent = n->parent;
+		*trie_link(trie, n) = child;
+		free(n);
+
+		/* Parent keeps the same number of children */
+		if (child != NULL) {
+			child->parent = parent;
+			break;
+		}
+
+		/* Parent might have become a needless glue node */
+		n = parent;
+	}
+}
+
+int nhrp_trie_foreach_path(struct nhrp_trie *trie,
+			   const struct nhrp_address *addr, int prefix,
+			   nhrp_trie_enumerator e, void *ctx)
+{
+	struct nhrp_trie_node *n;
+	uint8_t key[NHRP_TRIE_KEY_LEN];
+	int bits, rc;
+
+	bits = trie_key(key, addr, prefix);
+	for (n = trie->root; n != NULL && n->bits <= bits; ) {
+		if (trie_common_bits(n->key, key, n->bits) < n->bits)
+			break;
+
+		if (!list_empty(&n->entries)) {
+			rc = e(ctx, n);
+			if (rc != 0)
+				return rc;
+		}
+
+		if (n->bits == bits)
+			break;
+		n = n->child[trie_bit(key, n->bits)];
+	}
+
+	return 0;
+}
+
+static int trie_walk(struct nhrp_trie_node *n,
+		     nhrp_trie_enumerator e, void *ctx)
+{
+	int rc;
+
+	if (n == NULL)
+		return 0;
+
+	if (!list_empty(&n->entries)) {
+		rc = e(ctx, n);
+		if (rc != 0)
+			return rc;
+	}
+
+	rc = trie_walk(n->child[0], e, ctx);
+	if (rc != 0)
+		return rc;
+
+	return trie_walk(n->child[1], e, ctx);
+}
+
+int nhrp_trie_foreach_subtree(struct nhrp_trie *trie,
+			      const struct nhrp_address *addr, int prefix,
+			      nhrp_trie_enumerator e, void *ctx)
+{
+	struct nhrp_trie_node *n;
+	uint8_t key[NHRP_TRIE_KEY_LEN];
+	int bits;
+
+	bits = trie_key(key, addr, prefix);
+	for (n = trie->root; n != NULL && n->bits < bits; ) {
+		if (trie_common_bits(n->key, key, n->bits) < n->bits)
+			return 0;
+		n = n->child[trie_bit(key, n->bits)];
+	}
+
+	if (n == NULL || trie_common_bits(n->key, key, bits) < bits)
+		return 0;
+
+	return trie_walk(n, e, ctx);
+}
@@ -0,0 +1,44 @@
+/* nhrp_trie.h - Longest prefix match trie for protocol addresses
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#ifndef NHRP_TRIE_H
+#define NHRP_TRIE_H
+
+#include "nhrp_address.h"
+#include "list.h"
+
+/* Keys are the 16-bit address type followed by the address bits */
+#define NHRP_TRIE_KEY_LEN		(2 + NHRP_MAX_ADDRESS_LEN)
+
+struct nhrp_trie_node {
+	struct nhrp_trie_node *parent;
+	struct nhrp_trie_node *child[2];
+	struct list_head entries;
+	int bits;
+	uint8_t key[NHRP_TRIE_KEY_LEN];
+};
+
+struct nhrp_trie {
+	struct nhrp_trie_node *root;
+};
+
+typedef int (*nhrp_trie_enumerator)(void *ctx, struct nhrp_trie_node *node);
+
+struct nhrp_trie_node *nhrp_trie_get(struct nhrp_trie *trie,
+				     const struct nhrp_address *addr,
+				     int prefix);
+void nhrp_trie_put(struct nhrp_trie *trie, struct nhrp_trie_node *node);
+
+int nhrp_trie_foreach_path(struct nhrp_trie *trie,
+			   const struct nhrp_address *addr, int prefix,
+			   nhrp_trie_enumerator e, void *ctx);
+int nhrp_trie_foreach_subtree(struct nhrp_trie *trie,
+			      const struct nhrp_address *addr, int prefix,
+			      nhrp_trie_enumerator e, void *ctx);
+
+#endif
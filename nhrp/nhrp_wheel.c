@@ -0,0 +1,144 @@
+/* nhrp_wheel.c - Hierarchical timing wheel for coarse timers
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include "nhrp_wheel.h"
+
+#define NHRP_WHEEL_MAX_DELTA \
+	((1U << (NHRP_WHEEL_BITS * NHRP_WHEEL_LEVELS)) - 1)
+
+static uint32_t nhrp_wheel_clock(struct nhrp_wheel *wheel)
+{
+	return (uint32_t) ((ev_now() - wheel->epoch) / wheel->tick);
+}
+
+static void nhrp_wheel_insert(struct nhrp_wheel *wheel,
+			      struct nhrp_wheel_timer *t)
+{
+	uint32_t delta = t->expires - wheel->now;
+	int level, index;
+
+	if (delta > NHRP_WHEEL_MAX_DELTA) {
+		delta = NHRP_WHEEL_MAX_DELTA;
+		t->expires = wheel->now + delta;
+	}
+
+	/* Each level is indexed with its own bits of the absolute
+	 * expiry tick, so timers move down a level when the level
+	 * below wraps around */
+	for (level = 0; level < NHRP_WHEEL_LEVELS - 1; level++)
+		if (delta < (1U << (NHRP_WHEEL_BITS * (level + 1))))
+			break;
+
+	index = (t->expires >> (NHRP_WHEEL_BITS * level)) & NHRP_WHEEL_MASK;
+	list_add_tail(&t->entry, &wheel->slots[level][index]);
+}
+
+static void nhrp_wheel_cascade(struct nhrp_wheel *wheel, int level)
+{
+	struct list_head *slot;
+	struct nhrp_wheel_timer *t;
+	struct list_head tmp = LIST_INITIALIZER(tmp);
+
+	slot = &wheel->slots[level][(wheel->now >> (NHRP_WHEEL_BITS * level)) &
+				    NHRP_WHEEL_MASK];
+
+	/* Timers from this slot land on lower levels only */
+	while (!list_empty(slot)) {
+		t = list_next(slot, struct nhrp_wheel_timer, entry);
+		list_del(&t->entry);
+		list_add_tail(&t->entry, &tmp);
+	}
+	while (!list_empty(&tmp)) {
+		t = list_next(&tmp, struct nhrp_wheel_timer, entry);
+		list_del(&t->entry);
+		nhrp_wheel_insert(wheel, t);
+	}
+}
+
+static void nhrp_wheel_run(struct nhrp_wheel *wheel)
+{
+	struct list_head *slot;
+	struct nhrp_wheel_timer *t;
+	int level;
+
+	wheel->now++;
+	for (level = 1; level < NHRP_WHEEL_LEVELS; level++) {
+		if (wheel->now & ((1U << (NHRP_WHEEL_BITS * level)) - 1))
+			break;
+		nhrp_wheel_cascade(wheel, level);
+	}
+
+	/* Callbacks can only re-add timers to later slots */
+	slot = &wheel->slots[0][wheel->now & NHRP_WHEEL_MASK];
+	while (!list_empty(slot)) {
+		t = list_next(slot, struct nhrp_wheel_timer, entry);
+		list_del(&t->entry);
+		wheel->count--;
+		wheel->callback(wheel, t);
+	}
+}
+
+static void nhrp_wheel_tick_cb(struct ev_timer *w, int revents)
+{
+	struct nhrp_wheel *wheel = container_of(w, struct nhrp_wheel, timer);
+	uint32_t clock = nhrp_wheel_clock(wheel);
+
+	/* Catch up if the loop was blocked for several ticks */
+	while (wheel->count != 0 && (int32_t) (clock - wheel->now) > 0)
+		nhrp_wheel_run(wheel);
+
+	if (wheel->count == 0)
+		ev_timer_stop(&wheel->timer);
+}
+
+static void nhrp_wheel_start(struct nhrp_wheel *wheel)
+{
+	int i, j;
+
+	if (wheel->slots[0][0].next == NULL) {
+		for (i = 0; i < NHRP_WHEEL_LEVELS; i++)
+			for (j = 0; j < NHRP_WHEEL_SIZE; j++)
+				list_init(&wheel->slots[i][j]);
+		ev_timer_init(&wheel->timer, nhrp_wheel_tick_cb,
+			      wheel->tick, wheel->tick);
+		wheel->epoch = ev_now();
+	}
+
+	/* Empty slots between the last run and now need no visit */
+	wheel->now = nhrp_wheel_clock(wheel);
+	ev_timer_again(&wheel->timer);
+}
+
+void nhrp_wheel_add(struct nhrp_wheel *wheel, struct nhrp_wheel_timer *t,
+		    ev_tstamp timeout)
+{
+	ev_tstamp ticks;
+
+	if (nhrp_wheel_pending(t))
+		nhrp_wheel_del(wheel, t);
+	if (wheel->count++ == 0)
+		nhrp_wheel_start(wheel);
+
+	/* Round up so timers never fire early */
+	ticks = ceil((ev_now() - wheel->epoch + timeout) / wheel->tick);
+	if (ticks > (ev_tstamp) wheel->now + NHRP_WHEEL_MAX_DELTA)
+		ticks = (ev_tstamp) wheel->now + NHRP_WHEEL_MAX_DELTA;
+	t->expires = (uint32_t) ticks;
+	if ((int32_t) (t->expires - wheel->now) <= 0)
+		t->expires = wheel->now + 1;
+
+	nhrp_wheel_insert(wheel, t);
+}
+
+void nhrp_wheel_del(struct nhrp_wheel *wheel, struct nhrp_wheel_timer *t)
+{
+	list_del(&t->entry);
+	wheel->count--;
+}
@@ -0,0 +1,56 @@
+/* nhrp_wheel.h - Hierarchical timing wheel for coarse timers
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#ifndef NHRP_WHEEL_H
+#define NHRP_WHEEL_H
+
+#include <stdint.h>
+#include "libev.h"
+#include "list.h"
+
+#define NHRP_WHEEL_BITS			8
+#define NHRP_WHEEL_SIZE			(1 << NHRP_WHEEL_BITS)
+#define NHRP_WHEEL_MASK			(NHRP_WHEEL_SIZE - 1)
+#define NHRP_WHEEL_LEVELS		3
+
+struct nhrp_wheel;
+
+struct nhrp_wheel_timer {
+	struct list_head entry;
+	uint32_t expires;
+};
+
+typedef void (*nhrp_wheel_callback)(struct nhrp_wheel *wheel,
+				    struct nhrp_wheel_timer *timer);
+
+/* Timers expire on tick boundaries, at most one tick late. The wheel
+ * is driven by a single libev timer that runs only while timers are
+ * pending. With one second ticks the three levels cover about 194
+ * days; anything further out is kept in the last slot. */
+struct nhrp_wheel {
+	ev_tstamp tick;
+	ev_tstamp epoch;
+	nhrp_wheel_callback callback;
+	struct ev_timer timer;
+	uint32_t now;
+	unsigned int count;
+	struct list_head slots[NHRP_WHEEL_LEVELS][NHRP_WHEEL_SIZE];
+};
+
+#define NHRP_WHEEL_INITIALIZER(t, cb) { .tick = (t), .callback = (cb) }
+
+static inline int nhrp_wheel_pending(const struct nhrp_wheel_timer *t)
+{
+	return list_hashed(&t->entry);
+}
+
+void nhrp_wheel_add(struct nhrp_wheel *wheel, struct nhrp_wheel_timer *t,
+		    ev_tstamp timeout);
+void nhrp_wheel_del(struct nhrp_wheel *wheel, struct nhrp_wheel_timer *t);
+
+#endif
@@ -21,6 +21,7 @@
 #include "nhrp_common.h"
 #include "nhrp_peer.h"
 #include "nhrp_interface.h"
+#include "nhrp_script.h"
 
 const char *nhrp_version_string =
 	"OpenNHRP " OPENNHRP_VERSION
@@ -147,6 +148,8 @@ static int load_config(const char *config_file)
 		"dynamic-map requires a network address",
 		"bad multicast destination",
 		"keyword valid only for 'interace' and 'shortcut-target' definition",
+		"invalid number",
+		"invalid builtin action",
 	};
 	struct nhrp_interface *iface = NULL;
 	struct nhrp_peer *peer = NULL;
@@ -208,7 +211,7 @@ static int load_config(const char *config_file)
 			}
 			peer->protocol_type = nhrp_protocol_from_pf(
 				peer->protocol_address.type);
-			peer->nbma_hostname = strdup(nbma);
+			nhrp_peer_cold(peer)->nbma_hostname = strdup(nbma);
 			peer->afnum = nhrp_afnum_from_pf(
 				peer->next_hop_address.type);
 			nhrp_peer_insert(peer);
@@ -229,7 +232,7 @@ static int load_config(const char *config_file)
 				peer->protocol_address.type);
 			if (!nhrp_address_parse(nbma, &peer->next_hop_address,
 						NULL))
-				peer->nbma_hostname = strdup(nbma);
+				nhrp_peer_cold(peer)->nbma_hostname = strdup(nbma);
 			peer->afnum = nhrp_afnum_from_pf(peer->next_hop_address.type);
 			nhrp_peer_insert(peer);
 			nhrp_peer_put(peer);
@@ -253,6 +256,14 @@ static int load_config(const char *config_file)
 			} else {
 				rc = 7;
 			}
+		} else if (strcmp(word, "renew-jitter") == 0) {
+			NEED_INTERFACE();
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) < 0 || atoi(word) > 50) {
+				rc = 8;
+				break;
+			}
+			iface->renew_jitter = atoi(word);
 		} else if (strcmp(word, "cisco-authentication") == 0) {
 			struct nhrp_buffer *buf;
 			struct nhrp_cisco_authentication_extension *auth;
@@ -282,6 +293,76 @@ static int load_config(const char *config_file)
 		} else if (strcmp(word, "shortcut-destination") == 0) {
 			NEED_INTERFACE();
 			iface->flags |= NHRP_INTERFACE_FLAG_SHORTCUT_DEST;
+		} else if (strcmp(word, "packet-pool") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) <= 0) {
+				rc = 8;
+				break;
+			}
+			nhrp_packet_pool_reserve(atoi(word));
+		} else if (strcmp(word, "multicast-queue") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) <= 0) {
+				rc = 8;
+				break;
+			}
+			forward_queue_len = atoi(word);
+		} else if (strcmp(word, "rx-budget") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) <= 0) {
+				rc = 8;
+				break;
+			}
+			kernel_rx_budget = atoi(word);
+		} else if (strcmp(word, "rx-ring") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) < 0) {
+				rc = 8;
+				break;
+			}
+			kernel_rx_ring_blocks = atoi(word);
+		} else if (strcmp(word, "netlink-buffer") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) <= 0) {
+				rc = 8;
+				break;
+			}
+			kernel_netlink_buffer = atoi(word);
+		} else if (strcmp(word, "script-workers") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) < 0) {
+				rc = 8;
+				break;
+			}
+			nhrp_script_workers = atoi(word);
+		} else if (strcmp(word, "script-max-parallel") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) < 0) {
+				rc = 8;
+				break;
+			}
+			nhrp_script_max_parallel = atoi(word);
+		} else if (strcmp(word, "registration-rate") == 0) {
+			read_word(in, &lineno, sizeof(word), word);
+			if (atoi(word) < 0) {
+				rc = 8;
+				break;
+			}
+			server_registration_rate = atoi(word);
+		} else if (strcmp(word, "multicast-offload") == 0) {
+			NEED_INTERFACE();
+			iface->flags |= NHRP_INTERFACE_FLAG_MCAST_OFFLOAD;
+		} else if (strcmp(word, "builtin-action") == 0) {
+			NEED_INTERFACE();
+			read_word(in, &lineno, sizeof(word), word);
+			if (strcmp(word, "route") == 0) {
+				iface->flags |= NHRP_INTERFACE_FLAG_BUILTIN_ROUTE;
+			} else if (strcmp(word, "peer") == 0) {
+				iface->flags |= NHRP_INTERFACE_FLAG_BUILTIN_PEER;
+			} else {
+				rc = 9;
+				break;
+			}
 		} else if (strcmp(word, "multicast") == 0) {
 			NEED_INTERFACE();
 			read_word(in, &lineno, sizeof(word), word);
@@ -477,6 +558,7 @@ int main(int argc, char **argv)
 	}
 
 	srandom(time(NULL));
+	nhrp_hash_init();
 	if (!log_init())
 		return 1;
 	if (!open_pid_file())
@@ -505,6 +587,9 @@ int main(int argc, char **argv)
 
 	write_pid();
 
+	if (!nhrp_script_init())
+		return 9;
+
 	nhrp_running = TRUE;
 	ev_loop(0);
 	nhrp_running = FALSE;
@@ -512,6 +597,7 @@ int main(int argc, char **argv)
 	forward_cleanup();
 	kernel_stop_listening();
 	nhrp_peer_cleanup();
+	nhrp_script_cleanup();
 	kernel_cleanup();
 	nhrp_interface_cleanup();
 	nhrp_rate_limit_clear(&any, 0);
@@ -31,9 +31,14 @@
 #include "nhrp_common.h"
 #include "nhrp_interface.h"
 #include "nhrp_peer.h"
+#include "nhrp_hash.h"
+#include "sysdep_ring.h"
 
 #define NETLINK_KERNEL_BUFFER	(256 * 1024)
+#define NETLINK_BATCH_BUFFER	(32 * 1024)
+#define ROUTE_CACHE_MAX		1024
 #define NETLINK_RECV_BUFFER	(8 * 1024)
+#define NHRP_RTPROT		42
 
 #define NLMSG_TAIL(nmsg) \
 	((struct rtattr *) (((void *) (nmsg)) + NLMSG_ALIGN((nmsg)->nlmsg_len)))
@@ -62,7 +67,54 @@ static const int netlink_groups[] = {
 static struct netlink_fd netlink_fds[ARRAY_SIZE(netlink_groups)];
 #define talk_fd netlink_fds[0]
 
+/* Separate socket for asynchronous route queries, so that their
+ * replies are never mistaken for route notifications */
+static struct netlink_fd route_fd = { .fd = -1 };
+
 static struct ev_io packet_io;
+static struct packet_ring packet_ring;
+
+int kernel_rx_budget = 64;
+int kernel_rx_ring_blocks = 4;
+int kernel_netlink_buffer = NETLINK_KERNEL_BUFFER;
+struct kernel_stats kernel_stats;
+
+static struct ev_timer netlink_resync_timer;
+
+/* Neighbor updates queued during one loop iteration. Repeated updates
+ * to the same neighbor replace the earlier one, and everything is
+ * sent in as few multi-message buffers as possible before polling. */
+struct netlink_neigh_update {
+	struct list_head list_entry;
+	struct nhrp_hash_node hash_entry;
+	int ifindex;
+	struct nhrp_address neighbor;
+	struct nhrp_address hwaddr;
+};
+
+/* Results of RTM_GETROUTE keyed on the query. Any route change flushes
+ * the whole cache; the interface MTU is looked up on each hit. */
+struct route_cache_entry {
+	struct nhrp_hash_node hash_entry;
+	struct nhrp_address dest;
+	struct nhrp_address source;
+	int oif;
+
+	struct nhrp_address prefsrc;
+	struct nhrp_address gateway;
+	int nh_oif;
+};
+
+static struct nhrp_hash route_cache;
+static uint32_t *route_oif_map;
+static int route_oif_words;
+static int netlink_strict;
+static struct list_head route_queries = LIST_INITIALIZER(route_queries);
+
+static struct ev_prepare neigh_flush;
+static struct nhrp_hash neigh_hash;
+static struct list_head neigh_pending = LIST_INITIALIZER(neigh_pending);
+static struct list_head neigh_free = LIST_INITIALIZER(neigh_free);
 
 static uint16_t translate_mtu(uint16_t mtu)
 {
@@ -129,6 +181,15 @@ static int netlink_receive(struct netlink_fd *fd, struct nlmsghdr *reply)
 				continue;
 			if (errno == EAGAIN)
 				return reply == NULL;
+			if (errno == ENOBUFS) {
+				/* Notifications were lost, our view of the
+				 * kernel state needs to be refreshed */
+				nhrp_error("Netlink overrun, resyncing");
+				kernel_stats.netlink_overruns++;
+				if (!ev_is_active(&netlink_resync_timer))
+					ev_timer_start(&netlink_resync_timer);
+				continue;
+			}
 			nhrp_perror("Netlink overrun");
 			continue;
 		}
@@ -191,6 +252,124 @@ static int netlink_send(struct netlink_fd *fd, struct nlmsghdr *req)
 	return TRUE;
 }
 
+static int netlink_send_batch(struct netlink_fd *fd, void *buf, size_t len)
+{
+	struct sockaddr_nl nladdr;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	kernel_stats.netlink_batches++;
+	if (sendto(fd->fd, buf, len, 0, (struct sockaddr *) &nladdr,
+		   sizeof(nladdr)) < 0) {
+		nhrp_perror("Cannot talk to rtnetlink");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void netlink_neigh_flush(void)
+{
+	static uint8_t buf[NETLINK_BATCH_BUFFER];
+	struct netlink_neigh_update *u;
+	struct nlmsghdr *n;
+	struct ndmsg *ndm;
+	size_t len = 0;
+
+	while (!list_empty(&neigh_pending)) {
+		u = list_next(&neigh_pending, struct netlink_neigh_update,
+			      list_entry);
+
+		/* Room for header and both addresses */
+		if (len + NLMSG_SPACE(sizeof(struct ndmsg) + 64) > sizeof(buf)) {
+			netlink_send_batch(&talk_fd, buf, len);
+			len = 0;
+		}
+
+		n = (struct nlmsghdr *) &buf[len];
+		memset(n, 0, NLMSG_SPACE(sizeof(struct ndmsg)));
+		n->nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+		n->nlmsg_flags = NLM_F_REQUEST | NLM_F_REPLACE | NLM_F_CREATE;
+		n->nlmsg_type = RTM_NEWNEIGH;
+		n->nlmsg_seq = ++talk_fd.seq;
+
+		ndm = NLMSG_DATA(n);
+		ndm->ndm_family = u->neighbor.type;
+		ndm->ndm_ifindex = u->ifindex;
+		ndm->ndm_type = RTN_UNICAST;
+
+		netlink_add_rtattr_l(n, sizeof(buf) - len, NDA_DST,
+				     u->neighbor.addr, u->neighbor.addr_len);
+		if (u->hwaddr.type != PF_UNSPEC) {
+			ndm->ndm_state = NUD_REACHABLE;
+			netlink_add_rtattr_l(n, sizeof(buf) - len, NDA_LLADDR,
+					     u->hwaddr.addr, u->hwaddr.addr_len);
+		} else {
+			ndm->ndm_state = NUD_FAILED;
+		}
+		len += NLMSG_ALIGN(n->nlmsg_len);
+
+		list_del(&u->list_entry);
+		nhrp_hash_del(&neigh_hash, &u->hash_entry);
+		list_add(&u->list_entry, &neigh_free);
+	}
+
+	if (len != 0)
+		netlink_send_batch(&talk_fd, buf, len);
+}
+
+static void netlink_neigh_flush_cb(struct ev_prepare *w, int revents)
+{
+	netlink_neigh_flush();
+	ev_prepare_stop(w);
+}
+
+static unsigned int netlink_neigh_hash(int ifindex,
+				       const struct nhrp_address *neighbor)
+{
+	return nhrp_hash_address(neighbor) ^ ifindex;
+}
+
+static void netlink_neigh_queue(int ifindex, struct nhrp_address *neighbor,
+				struct nhrp_address *hwaddr)
+{
+	struct netlink_neigh_update *u;
+	struct hlist_node *n;
+	unsigned int hash;
+
+	kernel_stats.neigh_updates++;
+	hash = netlink_neigh_hash(ifindex, neighbor);
+	nhrp_hash_for_each_entry(u, n, &neigh_hash, hash, hash_entry) {
+		if (u->ifindex == ifindex &&
+		    nhrp_address_cmp(&u->neighbor, neighbor) == 0)
+			goto update;
+	}
+
+	if (!list_empty(&neigh_free)) {
+		u = list_next(&neigh_free, struct netlink_neigh_update,
+			      list_entry);
+		list_del(&u->list_entry);
+	} else {
+		u = malloc(sizeof(struct netlink_neigh_update));
+		if (u == NULL)
+			return;
+	}
+	u->ifindex = ifindex;
+	u->neighbor = *neighbor;
+	nhrp_hash_add(&neigh_hash, &u->hash_entry, hash);
+	list_add_tail(&u->list_entry, &neigh_pending);
+	ev_prepare_start(&neigh_flush);
+	goto set;
+
+update:
+	kernel_stats.neigh_coalesced++;
+set:
+	if (hwaddr != NULL)
+		u->hwaddr = *hwaddr;
+	else
+		nhrp_address_set_type(&u->hwaddr, PF_UNSPEC);
+}
+
 static int netlink_talk(struct netlink_fd *fd, struct nlmsghdr *req,
 		 size_t replysize, struct nlmsghdr *reply)
 {
@@ -207,29 +386,248 @@ static int netlink_talk(struct netlink_fd *fd, struct nlmsghdr *req,
 	return netlink_receive(fd, reply);
 }
 
-static int netlink_enumerate(struct netlink_fd *fd, int family, int type)
+static int netlink_enumerate_filtered(struct netlink_fd *fd, int family,
+				      int type, int table, int protocol)
 {
 	struct {
 		struct nlmsghdr nlh;
-		struct rtgenmsg g;
+		union {
+			struct rtgenmsg g;
+			struct ifinfomsg ifi;
+			struct ifaddrmsg ifa;
+			struct rtmsg rtm;
+		};
+		char buf[64];
 	} req;
 	struct sockaddr_nl addr;
+	uint32_t table_id = table;
 
 	memset(&addr, 0, sizeof(addr));
 	addr.nl_family = AF_NETLINK;
 
+	/* Strict checking wants the full header of the message type,
+	 * the family is the first byte of each one */
 	memset(&req, 0, sizeof(req));
-	req.nlh.nlmsg_len = sizeof(req);
+	switch (type) {
+	case RTM_GETLINK:
+		req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+		break;
+	case RTM_GETADDR:
+		req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+		break;
+	case RTM_GETROUTE:
+		req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+		break;
+	default:
+		req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+		break;
+	}
 	req.nlh.nlmsg_type = type;
 	req.nlh.nlmsg_flags = NLM_F_ROOT | NLM_F_MATCH | NLM_F_REQUEST;
 	req.nlh.nlmsg_pid = 0;
 	req.nlh.nlmsg_seq = ++fd->seq;
 	req.g.rtgen_family = family;
 
-	return sendto(fd->fd, (void *) &req, sizeof(req), 0,
+	if (type == RTM_GETROUTE) {
+		req.rtm.rtm_protocol = protocol;
+		if (table != 0) {
+			req.rtm.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+			netlink_add_rtattr_l(&req.nlh, sizeof(req), RTA_TABLE,
+					     &table_id, sizeof(table_id));
+		}
+	}
+
+	return sendto(fd->fd, (void *) &req, req.nlh.nlmsg_len, 0,
 		      (struct sockaddr *) &addr, sizeof(addr)) >= 0;
 }
 
+static int netlink_enumerate(struct netlink_fd *fd, int family, int type)
+{
+	return netlink_enumerate_filtered(fd, family, type, 0, 0);
+}
+
+static unsigned int route_cache_hash(const struct nhrp_address *dest,
+				     const struct nhrp_address *source,
+				     int oif)
+{
+	return nhrp_hash_address(dest) ^ nhrp_hash_address(source) ^ oif;
+}
+
+static struct route_cache_entry *route_cache_lookup(struct nhrp_address *dest,
+						    struct nhrp_address *source,
+						    int oif)
+{
+	struct route_cache_entry *e;
+	struct hlist_node *n;
+	unsigned int hash;
+
+	hash = route_cache_hash(dest, source, oif);
+	nhrp_hash_for_each_entry(e, n, &route_cache, hash, hash_entry) {
+		if (e->oif == oif &&
+		    nhrp_address_cmp(&e->dest, dest) == 0 &&
+		    nhrp_address_cmp(&e->source, source) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void route_cache_flush(void)
+{
+	struct route_cache_entry *e;
+	struct hlist_node *n, *nn;
+	unsigned int i;
+
+	if (route_cache.count == 0)
+		return;
+
+	nhrp_hash_finish_resize(&route_cache);
+	for (i = 0; i < route_cache.size; i++) {
+		hlist_for_each_entry_safe(e, n, nn, &route_cache.buckets[i],
+					  hash_entry.list)
+			free(e);
+	}
+	nhrp_hash_destroy(&route_cache);
+	kernel_stats.route_cache_flushes++;
+}
+
+/* Fill cache entry from RTM_NEWROUTE reply and add it to cache */
+static void route_cache_add(struct route_cache_entry *e, struct nlmsghdr *msg)
+{
+	struct rtmsg *r = NLMSG_DATA(msg);
+	struct rtattr *rta[RTA_MAX+1];
+	struct route_cache_entry *c;
+
+	netlink_parse_rtattr(rta, RTA_MAX, RTM_RTA(r), RTM_PAYLOAD(msg));
+
+	nhrp_address_set_type(&e->prefsrc, PF_UNSPEC);
+	if (rta[RTA_PREFSRC] != NULL)
+		nhrp_address_set(&e->prefsrc, e->dest.type,
+				 RTA_PAYLOAD(rta[RTA_PREFSRC]),
+				 RTA_DATA(rta[RTA_PREFSRC]));
+	if (rta[RTA_GATEWAY] != NULL)
+		nhrp_address_set(&e->gateway, e->dest.type,
+				 RTA_PAYLOAD(rta[RTA_GATEWAY]),
+				 RTA_DATA(rta[RTA_GATEWAY]));
+	else
+		e->gateway = e->dest;
+	e->nh_oif = 0;
+	if (rta[RTA_OIF] != NULL)
+		e->nh_oif = *(int*)RTA_DATA(rta[RTA_OIF]);
+
+	/* Only IPv4 route changes are monitored */
+	if (e->dest.type != PF_INET)
+		return;
+	if (route_cache_lookup(&e->dest, &e->source, e->oif) != NULL)
+		return;
+	if (route_cache.count >= ROUTE_CACHE_MAX)
+		route_cache_flush();
+
+	c = malloc(sizeof(struct route_cache_entry));
+	if (c == NULL)
+		return;
+	*c = *e;
+	memset(&c->hash_entry, 0, sizeof(c->hash_entry));
+	nhrp_hash_add(&route_cache, &c->hash_entry,
+		      route_cache_hash(&c->dest, &c->source, c->oif));
+}
+
+static void route_cache_result(struct route_cache_entry *e,
+			       struct nhrp_address *default_source,
+			       struct nhrp_address *next_hop,
+			       uint16_t *mtu)
+{
+	struct nhrp_interface *nbma_iface;
+
+	if (default_source != NULL && default_source->type == PF_UNSPEC &&
+	    e->prefsrc.type != PF_UNSPEC)
+		*default_source = e->prefsrc;
+
+	if (next_hop != NULL)
+		*next_hop = e->gateway;
+
+	if (mtu != NULL) {
+		*mtu = 0;
+
+		/* We use interface MTU here instead of the route
+		 * cache MTU from RTA_METRICS/RTAX_MTU since we
+		 * don't want to announce mtu if PMTU works */
+		nbma_iface = nhrp_interface_get_by_index(e->nh_oif, FALSE);
+		if (nbma_iface != NULL)
+			*mtu = translate_mtu(nbma_iface->mtu);
+	}
+}
+
+static void route_query_key(struct route_cache_entry *e,
+			    struct nhrp_interface *out_iface,
+			    struct nhrp_address *dest,
+			    struct nhrp_address *default_source)
+{
+	memset(e, 0, sizeof(*e));
+	e->dest = *dest;
+	if (default_source != NULL)
+		e->source = *default_source;
+	if (out_iface != NULL)
+		e->oif = out_iface->index;
+}
+
+static void route_query_build(struct nlmsghdr *n, size_t maxlen,
+			      struct route_cache_entry *e)
+{
+	struct rtmsg *r = NLMSG_DATA(n);
+
+	n->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	n->nlmsg_flags = NLM_F_REQUEST;
+	n->nlmsg_type = RTM_GETROUTE;
+	r->rtm_family = e->dest.type;
+
+	netlink_add_rtattr_l(n, maxlen, RTA_DST,
+			     e->dest.addr, e->dest.addr_len);
+	r->rtm_dst_len = e->dest.addr_len * 8;
+
+	if (e->source.type != PF_UNSPEC) {
+		netlink_add_rtattr_l(n, maxlen, RTA_SRC,
+				     e->source.addr, e->source.addr_len);
+		r->rtm_src_len = e->source.addr_len * 8;
+	}
+	if (e->oif != 0)
+		netlink_add_rtattr_l(n, maxlen, RTA_OIF,
+				     &e->oif, sizeof(int));
+}
+
+static void netlink_route_reply(struct nlmsghdr *msg)
+{
+	struct kernel_route_query *q;
+	struct route_cache_entry e;
+	struct nlmsgerr *err;
+
+	list_for_each_entry(q, &route_queries, pending_entry) {
+		if (q->seq == msg->nlmsg_seq)
+			goto found;
+	}
+	return;
+
+found:
+	list_del(&q->pending_entry);
+	if (msg->nlmsg_type == NLMSG_ERROR) {
+		err = NLMSG_DATA(msg);
+		errno = -err->error;
+		q->callback(q, FALSE);
+		return;
+	}
+
+	route_query_key(&e, NULL, &q->dest, &q->source);
+	e.oif = q->oif;
+	route_cache_add(&e, msg);
+	route_cache_result(&e, &q->source, &q->next_hop, &q->mtu);
+	q->callback(q, TRUE);
+}
+
+static const netlink_dispatch_f route_reply_dispatch[RTM_NEWROUTE+1] = {
+	[NLMSG_ERROR] = netlink_route_reply,
+	[RTM_NEWROUTE] = netlink_route_reply,
+};
+
 static void netlink_read_cb(struct ev_io *w, int revents)
 {
 	struct netlink_fd *nfd = container_of(w, struct netlink_fd, io);
@@ -258,8 +656,6 @@ static int do_get_ioctl(const char *basedev, struct ip_tunnel_parm *p)
 	return TRUE;
 }
 
-#ifndef NHRP_NO_NBMA_GRE
-
 static int netlink_add_nested_rtattr_u32(struct rtattr *rta, int maxlen,
 					 int type, uint32_t value)
 {
@@ -277,6 +673,8 @@ static int netlink_add_nested_rtattr_u32(struct rtattr *rta, int maxlen,
 	return TRUE;
 }
 
+#ifndef NHRP_NO_NBMA_GRE
+
 static int netlink_configure_arp(struct nhrp_interface *iface, int pf)
 {
 	struct {
@@ -436,6 +834,128 @@ static void netlink_neigh_update(struct nlmsghdr *msg)
 			  (void*) (intptr_t) used, &sel);
 }
 
+static int netlink_route_oif_set(void *ctx, struct nhrp_interface *iface)
+{
+	uint32_t *map;
+	int words;
+
+	if (iface->index <= 0)
+		return 0;
+	if (!(iface->flags & (NHRP_INTERFACE_FLAG_CONFIGURED |
+			      NHRP_INTERFACE_FLAG_SHORTCUT_DEST)))
+		return 0;
+
+	words = iface->index / 32 + 1;
+	if (words > route_oif_words) {
+		map = realloc(route_oif_map, words * sizeof(uint32_t));
+		if (map == NULL)
+			return 0;
+		memset(&map[route_oif_words], 0,
+		       (words - route_oif_words) * sizeof(uint32_t));
+		route_oif_map = map;
+		route_oif_words = words;
+	}
+	route_oif_map[iface->index / 32] |= 1U << (iface->index % 32);
+
+	return 0;
+}
+
+/* Rebuild the bitmap of interfaces whose routes are followed */
+static void netlink_route_oif_update(void)
+{
+	if (route_oif_map != NULL)
+		memset(route_oif_map, 0, route_oif_words * sizeof(uint32_t));
+	nhrp_interface_foreach(netlink_route_oif_set, NULL);
+}
+
+static int netlink_route_oif_test(int index)
+{
+	if (index <= 0 || index / 32 >= route_oif_words)
+		return FALSE;
+	return route_oif_map[index / 32] & (1U << (index % 32));
+}
+
+/* Decide from the header and the output interface alone whether a
+ * route is relevant, so uninteresting routes from a full table are
+ * dropped before their attributes get parsed. */
+static struct nhrp_interface *netlink_route_interface(struct nlmsghdr *msg,
+						      int *type)
+{
+	struct nhrp_interface *iface;
+	struct rtmsg *rtm = NLMSG_DATA(msg);
+	struct rtattr *rta;
+	unsigned int table = rtm->rtm_table;
+	int len = RTM_PAYLOAD(msg), oif = 0;
+
+	if (rtm->rtm_family != PF_INET)
+		return NULL;
+
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_OIF)
+			oif = *(int*)RTA_DATA(rta);
+		else if (rta->rta_type == RTA_TABLE)
+			table = *(uint32_t*)RTA_DATA(rta);
+	}
+
+	if (!netlink_route_oif_test(oif)) {
+		kernel_stats.routes_filtered++;
+		return NULL;
+	}
+
+	iface = nhrp_interface_get_by_index(oif, FALSE);
+	if (iface == NULL)
+		return NULL;
+
+	if (iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT_DEST) {
+		/* Off-NBMA bound routes, include kernel subnet
+		 * routes, and anything routing table. */
+		if (table != iface->route_table &&
+		    rtm->rtm_protocol != RTPROT_KERNEL)
+			return NULL;
+		*type = NHRP_PEER_TYPE_LOCAL_ADDR;
+	} else if (iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED) {
+		/* In-NBMA bound routes, include only specifed table
+		 * and only non-kernel created routes */
+		if (table != iface->route_table ||
+		    rtm->rtm_protocol == RTPROT_KERNEL)
+			return NULL;
+		*type = NHRP_PEER_TYPE_LOCAL_ROUTE;
+	} else {
+		return NULL;
+	}
+
+	return iface;
+}
+
+static int netlink_peer_keep(void *ctx, struct nhrp_peer *peer)
+{
+	struct nhrp_peer *np = (struct nhrp_peer *) ctx;
+
+	if (peer->interface != np->interface ||
+	    nhrp_address_cmp(&peer->next_hop_address,
+			     &np->next_hop_address) != 0)
+		return 0;
+
+	peer->flags &= ~NHRP_PEER_FLAG_MARK;
+	return 1;
+}
+
+/* Check if an identical local entry is already cached. Repeated
+ * notifications and resync dumps then keep the existing peer. */
+static int netlink_peer_known(struct nhrp_peer *peer)
+{
+	struct nhrp_peer_selector sel;
+
+	memset(&sel, 0, sizeof(sel));
+	sel.flags = NHRP_PEER_FIND_EXACT;
+	sel.type_mask = BIT(peer->type);
+	sel.interface = peer->interface;
+	sel.protocol_address = peer->protocol_address;
+	sel.prefix_length = peer->prefix_length;
+
+	return nhrp_peer_foreach(netlink_peer_keep, peer, &sel) != 0;
+}
+
 static void netlink_link_new(struct nlmsghdr *msg)
 {
 	struct nhrp_interface *iface;
@@ -454,6 +974,7 @@ static void netlink_link_new(struct nlmsghdr *msg)
 	if (iface == NULL)
 		return;
 
+	iface->flags &= ~NHRP_INTERFACE_FLAG_MARK;
 	if (rta[IFLA_MTU])
 		iface->mtu = *((unsigned*)RTA_DATA(rta[IFLA_MTU]));
 
@@ -469,6 +990,7 @@ static void netlink_link_new(struct nlmsghdr *msg)
 
 	iface->index = ifi->ifi_index;
 	nhrp_interface_hash(iface);
+	netlink_route_oif_update();
 
 	if (!(iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED))
 		return;
@@ -539,29 +1061,33 @@ static void netlink_link_new(struct nlmsghdr *msg)
 	}
 }
 
+static void netlink_link_gone(struct nhrp_interface *iface)
+{
+	nhrp_info("Interface '%s' deleted", iface->name);
+	iface->index = 0;
+	iface->link_index = 0;
+	nhrp_interface_hash(iface);
+	netlink_route_oif_update();
+
+	nhrp_address_set_type(&iface->nbma_address, PF_UNSPEC);
+	nhrp_address_set_type(&iface->protocol_address, PF_UNSPEC);
+}
+
 static void netlink_link_del(struct nlmsghdr *msg)
 {
 	struct nhrp_interface *iface;
 	struct ifinfomsg *ifi = NLMSG_DATA(msg);
 	struct rtattr *rta[IFLA_MAX+1];
-	const char *ifname;
 
 	netlink_parse_rtattr(rta, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(msg));
 	if (rta[IFLA_IFNAME] == NULL)
 		return;
 
-	ifname = RTA_DATA(rta[IFLA_IFNAME]);
-	iface = nhrp_interface_get_by_name(ifname, FALSE);
+	iface = nhrp_interface_get_by_name(RTA_DATA(rta[IFLA_IFNAME]), FALSE);
 	if (iface == NULL)
 		return;
 
-	nhrp_info("Interface '%s' deleted", ifname);
-	iface->index = 0;
-	iface->link_index = 0;
-	nhrp_interface_hash(iface);
-
-	nhrp_address_set_type(&iface->nbma_address, PF_UNSPEC);
-	nhrp_address_set_type(&iface->protocol_address, PF_UNSPEC);
+	netlink_link_gone(iface);
 }
 
 static int netlink_addr_new_nbma(void *ctx, struct nhrp_interface *iface)
@@ -620,6 +1146,7 @@ static void netlink_addr_new(struct nlmsghdr *msg)
 
 	peer = nhrp_peer_alloc(iface);
 	peer->type = NHRP_PEER_TYPE_LOCAL_ADDR;
+	peer->flags |= NHRP_PEER_FLAG_KERNEL;
 	peer->afnum = AFNUM_RESERVED;
 	nhrp_address_set(&peer->protocol_address, ifa->ifa_family,
 			 RTA_PAYLOAD(rta[IFA_LOCAL]),
@@ -628,7 +1155,8 @@ static void netlink_addr_new(struct nlmsghdr *msg)
 	case PF_INET:
 		peer->protocol_type = ETHPROTO_IP;
 		peer->prefix_length = peer->protocol_address.addr_len * 8;
-		nhrp_peer_insert(peer);
+		if (!netlink_peer_known(peer))
+			nhrp_peer_insert(peer);
 		break;
 	default:
 		nhrp_peer_put(peer);
@@ -637,6 +1165,7 @@ static void netlink_addr_new(struct nlmsghdr *msg)
 
 	bcast = nhrp_peer_alloc(iface);
 	bcast->type = peer->type;
+	bcast->flags |= NHRP_PEER_FLAG_KERNEL;
 	bcast->afnum = peer->afnum;
 	bcast->protocol_type = peer->protocol_type;
 	bcast->prefix_length = peer->prefix_length;
@@ -644,7 +1173,8 @@ static void netlink_addr_new(struct nlmsghdr *msg)
 	nhrp_address_set_broadcast(&bcast->protocol_address,
 				   ifa->ifa_prefixlen);
 	bcast->next_hop_address = peer->protocol_address;
-	nhrp_peer_insert(bcast);
+	if (!netlink_peer_known(bcast))
+		nhrp_peer_insert(bcast);
 	nhrp_peer_put(bcast);
 
 	nhrp_peer_put(peer);
@@ -725,38 +1255,19 @@ static void netlink_route_new(struct nlmsghdr *msg)
 	struct rtattr *rta[RTA_MAX+1];
 	int type = 0;
 
-	netlink_parse_rtattr(rta, RTA_MAX, RTM_RTA(rtm), RTM_PAYLOAD(msg));
-	if (rta[RTA_OIF] == NULL || rta[RTA_DST] == NULL)
-		return;
+	route_cache_flush();
 
-	if (rtm->rtm_family != PF_INET)
-		return;
-
-	iface = nhrp_interface_get_by_index(*(int*)RTA_DATA(rta[RTA_OIF]),
-					    FALSE);
+	iface = netlink_route_interface(msg, &type);
 	if (iface == NULL)
 		return;
 
-	if (iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT_DEST) {
-		/* Off-NBMA bound routes, include kernel subnet
-		 * routes, and anything routing table. */
-		if (rtm->rtm_table != iface->route_table &&
-		    rtm->rtm_protocol != RTPROT_KERNEL)
-			return;
-		type = NHRP_PEER_TYPE_LOCAL_ADDR;
-	} else if (iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED) {
-		/* In-NBMA bound routes, include only specifed table
-		 * and only non-kernel created routes */
-		if (rtm->rtm_table != iface->route_table ||
-		    rtm->rtm_protocol == RTPROT_KERNEL)
-			return;
-		type = NHRP_PEER_TYPE_LOCAL_ROUTE;
-	}
-	if (type == 0)
+	netlink_parse_rtattr(rta, RTA_MAX, RTM_RTA(rtm), RTM_PAYLOAD(msg));
+	if (rta[RTA_DST] == NULL)
 		return;
 
 	peer = nhrp_peer_alloc(iface);
 	peer->type = type;
+	peer->flags |= NHRP_PEER_FLAG_KERNEL;
 	peer->afnum = AFNUM_RESERVED;
 	nhrp_address_set(&peer->protocol_address, rtm->rtm_family,
 			 RTA_PAYLOAD(rta[RTA_DST]),
@@ -769,7 +1280,8 @@ static void netlink_route_new(struct nlmsghdr *msg)
 	}
 	peer->protocol_type = nhrp_protocol_from_pf(rtm->rtm_family);
 	peer->prefix_length = rtm->rtm_dst_len;
-	nhrp_peer_insert(peer);
+	if (!netlink_peer_known(peer))
+		nhrp_peer_insert(peer);
 	nhrp_peer_put(peer);
 }
 
@@ -781,34 +1293,14 @@ static void netlink_route_del(struct nlmsghdr *msg)
 	struct nhrp_peer_selector sel;
 	int type = 0;
 
-	netlink_parse_rtattr(rta, RTA_MAX, RTM_RTA(rtm), RTM_PAYLOAD(msg));
-	if (rta[RTA_OIF] == NULL || rta[RTA_DST] == NULL)
-		return;
-
-	if (rtm->rtm_family != PF_INET)
-		return;
+	route_cache_flush();
 
-	iface = nhrp_interface_get_by_index(*(int*)RTA_DATA(rta[RTA_OIF]),
-					    FALSE);
+	iface = netlink_route_interface(msg, &type);
 	if (iface == NULL)
 		return;
 
-	if (iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT_DEST) {
-		/* Off-NBMA bound routes, include kernel subnet
-		 * routes, and anything routing table. */
-		if (rtm->rtm_table != iface->route_table &&
-		    rtm->rtm_protocol != RTPROT_KERNEL)
-			return;
-		type = NHRP_PEER_TYPE_LOCAL_ADDR;
-	} else if (iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED) {
-		/* In-NBMA bound routes, include only specifed table
-		 * and only non-kernel created routes */
-		if (rtm->rtm_table != iface->route_table ||
-		    rtm->rtm_protocol == RTPROT_KERNEL)
-			return;
-		type = NHRP_PEER_TYPE_LOCAL_ROUTE;
-	}
-	if (type == 0)
+	netlink_parse_rtattr(rta, RTA_MAX, RTM_RTA(rtm), RTM_PAYLOAD(msg));
+	if (rta[RTA_DST] == NULL)
 		return;
 
 	memset(&sel, 0, sizeof(sel));
@@ -857,7 +1349,7 @@ static void netlink_close(struct netlink_fd *fd)
 static int netlink_open(struct netlink_fd *fd, int protocol, int groups)
 {
 	struct sockaddr_nl addr;
-	int buf = NETLINK_KERNEL_BUFFER;
+	int buf = kernel_netlink_buffer;
 
 	fd->fd = socket(AF_NETLINK, SOCK_RAW, protocol);
 	fd->seq = time(NULL);
@@ -872,7 +1364,11 @@ static int netlink_open(struct netlink_fd *fd, int protocol, int groups)
 		goto error;
 	}
 
-	if (setsockopt(fd->fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf)) < 0) {
+	/* SO_RCVBUFFORCE exceeds rmem_max, but needs CAP_NET_ADMIN.
+	 * NETLINK_NO_ENOBUFS is left unset so overruns get reported. */
+	if (setsockopt(fd->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &buf, sizeof(buf)) < 0 &&
+	    setsockopt(fd->fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf)) < 0) {
 		nhrp_perror("SO_RCVBUF");
 		goto error;
 	}
@@ -895,10 +1391,40 @@ error:
 	return FALSE;
 }
 
+static void pfpacket_deliver(uint8_t *buf, size_t len,
+			     struct sockaddr_ll *lladdr)
+{
+	struct nhrp_interface *iface;
+	struct nhrp_address from;
+
+	iface = nhrp_interface_get_by_index(lladdr->sll_ifindex, FALSE);
+	if (iface == NULL)
+		return;
+
+	nhrp_address_set(&from, PF_INET, lladdr->sll_halen, lladdr->sll_addr);
+	if (memcmp(lladdr->sll_addr, "\x00\x00\x00\x00", 4) == 0)
+		nhrp_address_set_type(&from, PF_UNSPEC);
+	nhrp_packet_receive(buf, len, iface, &from);
+}
+
+static void pfpacket_ring_read_cb(struct ev_io *w, int revents)
+{
+	struct tpacket3_hdr *hdr;
+	int i;
+
+	for (i = 0; i < kernel_rx_budget; i++) {
+		hdr = packet_ring_next(&packet_ring);
+		if (hdr == NULL)
+			return;
+
+		pfpacket_deliver((uint8_t *) hdr + hdr->tp_net,
+				 hdr->tp_snaplen, packet_ring_lladdr(hdr));
+	}
+}
+
 static void pfpacket_read_cb(struct ev_io *w, int revents)
 {
 	struct sockaddr_ll lladdr;
-	struct nhrp_interface *iface;
 	struct iovec iov;
 	struct msghdr msg = {
 		.msg_name = &lladdr,
@@ -907,12 +1433,11 @@ static void pfpacket_read_cb(struct ev_io *w, int revents)
 		.msg_iovlen = 1,
 	};
 	uint8_t buf[1500];
-	struct nhrp_address from;
 	int fd = w->fd;
 	int i;
 
 	iov.iov_base = buf;
-	for (i = 0; i < 2; i++) {
+	for (i = 0; i < kernel_rx_budget; i++) {
 		int status;
 
 		iov.iov_len = sizeof(buf);
@@ -931,20 +1456,130 @@ static void pfpacket_read_cb(struct ev_io *w, int revents)
 			return;
 		}
 
-		iface = nhrp_interface_get_by_index(lladdr.sll_ifindex, FALSE);
-		if (iface == NULL)
-			continue;
+		pfpacket_deliver(buf, status, &lladdr);
+	}
+}
+
+struct netlink_route_tables {
+	unsigned int table[32];
+	int num;
+	int kernel_routes;
+};
+
+static int netlink_route_table_add(void *ctx, struct nhrp_interface *iface)
+{
+	struct netlink_route_tables *t = (struct netlink_route_tables *) ctx;
+	int i;
+
+	if (iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT_DEST)
+		t->kernel_routes = TRUE;
+	else if (!(iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED))
+		return 0;
+
+	for (i = 0; i < t->num; i++)
+		if (t->table[i] == iface->route_table)
+			return 0;
+	if (t->num >= ARRAY_SIZE(t->table))
+		return 1;
+
+	t->table[t->num++] = iface->route_table;
+	return 0;
+}
+
+/* With strict checking the kernel filters the dumps: only the routing
+ * tables of our interfaces, and the kernel created subnet routes for
+ * shortcut destinations, instead of every route in the system. */
+static void netlink_dump_routes(void)
+{
+	struct netlink_route_tables t;
+	int i;
+
+	memset(&t, 0, sizeof(t));
+	if (!netlink_strict ||
+	    nhrp_interface_foreach(netlink_route_table_add, &t) != 0) {
+		netlink_enumerate(&talk_fd, PF_INET, RTM_GETROUTE);
+		netlink_read_cb(&talk_fd.io, EV_READ);
+		return;
+	}
+
+	for (i = 0; i < t.num; i++) {
+		netlink_enumerate_filtered(&talk_fd, PF_INET, RTM_GETROUTE,
+					   t.table[i], 0);
+		netlink_read_cb(&talk_fd.io, EV_READ);
+	}
+	if (t.kernel_routes) {
+		netlink_enumerate_filtered(&talk_fd, PF_INET, RTM_GETROUTE,
+					   0, RTPROT_KERNEL);
+		netlink_read_cb(&talk_fd.io, EV_READ);
+	}
+}
+
+static void netlink_dump_all(void)
+{
+	netlink_enumerate(&talk_fd, PF_UNSPEC, RTM_GETLINK);
+	netlink_read_cb(&talk_fd.io, EV_READ);
+
+	netlink_enumerate(&talk_fd, PF_UNSPEC, RTM_GETADDR);
+	netlink_read_cb(&talk_fd.io, EV_READ);
 
-		nhrp_address_set(&from, PF_INET, lladdr.sll_halen, lladdr.sll_addr);
-		if (memcmp(lladdr.sll_addr, "\x00\x00\x00\x00", 4) == 0)
-			nhrp_address_set_type(&from, PF_UNSPEC);
-		nhrp_packet_receive(buf, status, iface, &from);
+	netlink_dump_routes();
+}
+
+static int netlink_mark_interface(void *ctx, struct nhrp_interface *iface)
+{
+	if (iface->index != 0)
+		iface->flags |= NHRP_INTERFACE_FLAG_MARK;
+	return 0;
+}
+
+static int netlink_sweep_interface(void *ctx, struct nhrp_interface *iface)
+{
+	if (iface->flags & NHRP_INTERFACE_FLAG_MARK) {
+		iface->flags &= ~NHRP_INTERFACE_FLAG_MARK;
+		netlink_link_gone(iface);
+		(*(int *) ctx)++;
 	}
+	return 0;
+}
+
+static int netlink_mark_peer(void *ctx, struct nhrp_peer *peer)
+{
+	/* Configured entries, like shortcut-target, are never dumped */
+	if (peer->flags & NHRP_PEER_FLAG_KERNEL)
+		peer->flags |= NHRP_PEER_FLAG_MARK;
+	return 0;
+}
+
+/* Re-read the kernel state after lost notifications. Everything
+ * learned from the kernel is marked, the dumps unmark what still
+ * exists, and only the leftovers are removed. */
+static void netlink_resync_cb(struct ev_timer *w, int revents)
+{
+	struct nhrp_peer_selector sel;
+	int links = 0, peers = 0;
+
+	kernel_stats.netlink_resyncs++;
+	route_cache_flush();
+
+	nhrp_interface_foreach(netlink_mark_interface, NULL);
+	memset(&sel, 0, sizeof(sel));
+	sel.type_mask = BIT(NHRP_PEER_TYPE_LOCAL_ADDR) |
+			BIT(NHRP_PEER_TYPE_LOCAL_ROUTE);
+	nhrp_peer_foreach(netlink_mark_peer, NULL, &sel);
+
+	netlink_dump_all();
+
+	nhrp_interface_foreach(netlink_sweep_interface, &links);
+	sel.flags = NHRP_PEER_FIND_MARK;
+	nhrp_peer_foreach(nhrp_peer_remove_matching, &peers, &sel);
+
+	nhrp_info("Netlink resync done: %d interfaces and %d local "
+		  "entries removed", links, peers);
 }
 
 int kernel_init(void)
 {
-	int fd, i;
+	int fd, i, one;
 
 	proc_icmp_redirect_off("all");
 
@@ -955,9 +1590,23 @@ int kernel_init(void)
 	}
 
 	fcntl(fd, F_SETFD, FD_CLOEXEC);
-	ev_io_init(&packet_io, pfpacket_read_cb, fd, EV_READ);
+	if (packet_ring_open(&packet_ring, fd, kernel_rx_ring_blocks)) {
+		nhrp_debug("PF_PACKET receive ring with %d blocks",
+			   kernel_rx_ring_blocks);
+		ev_io_init(&packet_io, pfpacket_ring_read_cb, fd, EV_READ);
+	} else {
+		ev_io_init(&packet_io, pfpacket_read_cb, fd, EV_READ);
+	}
 	ev_io_start(&packet_io);
 
+	ev_prepare_init(&neigh_flush, netlink_neigh_flush_cb);
+	ev_timer_init(&netlink_resync_timer, netlink_resync_cb, 0.1, 0.);
+
+	route_fd.dispatch_size = ARRAY_SIZE(route_reply_dispatch);
+	route_fd.dispatch = route_reply_dispatch;
+	if (!netlink_open(&route_fd, NETLINK_ROUTE, 0))
+		goto err_close_all;
+
 	for (i = 0; i < ARRAY_SIZE(netlink_groups); i++) {
 		netlink_fds[i].dispatch_size = sizeof(route_dispatch) / sizeof(route_dispatch[0]);
 		netlink_fds[i].dispatch = route_dispatch;
@@ -966,14 +1615,13 @@ int kernel_init(void)
 			goto err_close_all;
 	}
 
-	netlink_enumerate(&talk_fd, PF_UNSPEC, RTM_GETLINK);
-	netlink_read_cb(&talk_fd.io, EV_READ);
-
-	netlink_enumerate(&talk_fd, PF_UNSPEC, RTM_GETADDR);
-	netlink_read_cb(&talk_fd.io, EV_READ);
-
-	netlink_enumerate(&talk_fd, PF_UNSPEC, RTM_GETROUTE);
-	netlink_read_cb(&talk_fd.io, EV_READ);
+#ifdef NETLINK_GET_STRICT_CHK
+	one = 1;
+	netlink_strict = setsockopt(talk_fd.fd, SOL_NETLINK,
+				    NETLINK_GET_STRICT_CHK,
+				    &one, sizeof(one)) == 0;
+#endif
+	netlink_dump_all();
 
 	return TRUE;
 
@@ -988,16 +1636,36 @@ void kernel_stop_listening(void)
 
 	for (i = 0; i < ARRAY_SIZE(netlink_groups); i++)
 		netlink_stop_listening(&netlink_fds[i]);
+	netlink_stop_listening(&route_fd);
+	ev_timer_stop(&netlink_resync_timer);
 	ev_io_stop(&packet_io);
 }
 
 void kernel_cleanup(void)
 {
+	struct netlink_neigh_update *u;
 	int i;
 
+	/* Updates queued while tearing down peers */
+	ev_prepare_stop(&neigh_flush);
+	netlink_neigh_flush();
+	while (!list_empty(&neigh_free)) {
+		u = list_next(&neigh_free, struct netlink_neigh_update,
+			      list_entry);
+		list_del(&u->list_entry);
+		free(u);
+	}
+	nhrp_hash_destroy(&neigh_hash);
+	route_cache_flush();
+	free(route_oif_map);
+	route_oif_map = NULL;
+	route_oif_words = 0;
+
 	for (i = 0; i < ARRAY_SIZE(netlink_groups); i++)
 		netlink_close(&netlink_fds[i]);
+	netlink_close(&route_fd);
 	ev_io_stop(&packet_io);
+	packet_ring_close(&packet_ring, packet_io.fd);
 	close(packet_io.fd);
 }
 
@@ -1012,69 +1680,77 @@ int kernel_route(struct nhrp_interface *out_iface,
 		struct rtmsg 		r;
 		char   			buf[1024];
 	} req;
-	struct rtmsg *r = NLMSG_DATA(&req.n);
-	struct rtattr *rta[RTA_MAX+1];
-
-	memset(&req, 0, sizeof(req));
-	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
-	req.n.nlmsg_flags = NLM_F_REQUEST;
-	req.n.nlmsg_type = RTM_GETROUTE;
-	req.r.rtm_family = dest->type;
+	struct route_cache_entry e, *c;
 
-	netlink_add_rtattr_l(&req.n, sizeof(req), RTA_DST,
-			     dest->addr, dest->addr_len);
-	req.r.rtm_dst_len = dest->addr_len * 8;
-
-	if (default_source != NULL && default_source->type != PF_UNSPEC)
-		netlink_add_rtattr_l(&req.n, sizeof(req), RTA_SRC,
-				     default_source->addr,
-				     default_source->addr_len);
-	if (out_iface != NULL)
-		netlink_add_rtattr_l(&req.n, sizeof(req), RTA_OIF,
-				     &out_iface->index, sizeof(int));
+	route_query_key(&e, out_iface, dest, default_source);
+	c = route_cache_lookup(&e.dest, &e.source, e.oif);
+	if (c != NULL) {
+		kernel_stats.route_cache_hits++;
+		route_cache_result(c, default_source, next_hop, mtu);
+		return TRUE;
+	}
+	kernel_stats.route_cache_misses++;
 
+	memset(&req, 0, sizeof(req));
+	route_query_build(&req.n, sizeof(req), &e);
 	if (!netlink_talk(&talk_fd, &req.n, sizeof(req), &req.n))
 		return FALSE;
 
-	netlink_parse_rtattr(rta, RTA_MAX, RTM_RTA(r), RTM_PAYLOAD(&req.n));
+	route_cache_add(&e, &req.n);
+	route_cache_result(&e, default_source, next_hop, mtu);
 
-	if (default_source != NULL && default_source->type == PF_UNSPEC &&
-	    rta[RTA_PREFSRC] != NULL) {
-		nhrp_address_set(default_source, dest->type,
-				 RTA_PAYLOAD(rta[RTA_PREFSRC]),
-				 RTA_DATA(rta[RTA_PREFSRC]));
-	}
+	return TRUE;
+}
 
-	if (next_hop != NULL) {
-		if (rta[RTA_GATEWAY] != NULL) {
-			nhrp_address_set(next_hop, dest->type,
-					 RTA_PAYLOAD(rta[RTA_GATEWAY]),
-					 RTA_DATA(rta[RTA_GATEWAY]));
-		} else {
-			*next_hop = *dest;
-		}
+int kernel_route_query(struct kernel_route_query *query,
+		       struct nhrp_interface *out_iface,
+		       struct nhrp_address *dest,
+		       struct nhrp_address *default_source,
+		       kernel_route_callback callback)
+{
+	struct {
+		struct nlmsghdr 	n;
+		struct rtmsg 		r;
+		char   			buf[1024];
+	} req;
+	struct route_cache_entry e, *c;
+
+	kernel_route_cancel(query);
+
+	route_query_key(&e, out_iface, dest, default_source);
+	query->callback = callback;
+	query->dest = e.dest;
+	query->source = e.source;
+	query->oif = e.oif;
+
+	c = route_cache_lookup(&e.dest, &e.source, e.oif);
+	if (c != NULL) {
+		kernel_stats.route_cache_hits++;
+		route_cache_result(c, &query->source, &query->next_hop,
+				   &query->mtu);
+		callback(query, TRUE);
+		return TRUE;
 	}
+	kernel_stats.route_cache_misses++;
 
-	if (mtu != NULL) {
-		*mtu = 0;
-
-		if (rta[RTA_OIF] != NULL) {
-			struct nhrp_interface *nbma_iface;
-
-			/* We use interface MTU here instead of the route
-			 * cache MTU from RTA_METRICS/RTAX_MTU since we
-			 * don't want to announce mtu if PMTU works */
-			nbma_iface = nhrp_interface_get_by_index(
-				*(int*)RTA_DATA(rta[RTA_OIF]),
-				FALSE);
-			if (nbma_iface != NULL)
-				*mtu = translate_mtu(nbma_iface->mtu);
-		}
+	memset(&req, 0, sizeof(req));
+	route_query_build(&req.n, sizeof(req), &e);
+	if (!netlink_send(&route_fd, &req.n)) {
+		callback(query, FALSE);
+		return FALSE;
 	}
 
+	query->seq = req.n.nlmsg_seq;
+	list_add_tail(&query->pending_entry, &route_queries);
 	return TRUE;
 }
 
+void kernel_route_cancel(struct kernel_route_query *query)
+{
+	if (list_hashed(&query->pending_entry))
+		list_del(&query->pending_entry);
+}
+
 int kernel_send(uint8_t *packet, size_t bytes, struct nhrp_interface *out,
 		struct nhrp_address *to)
 {
@@ -1117,44 +1793,137 @@ int kernel_inject_neighbor(struct nhrp_address *neighbor,
 			   struct nhrp_address *hwaddr,
 			   struct nhrp_interface *dev)
 {
-	struct {
-		struct nlmsghdr 	n;
-		struct ndmsg 		ndm;
-		char   			buf[256];
-	} req;
 	char neigh[64], nbma[64];
 
-	memset(&req.n, 0, sizeof(req.n));
-	memset(&req.ndm, 0, sizeof(req.ndm));
-
-	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
-	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_REPLACE | NLM_F_CREATE;
-	req.n.nlmsg_type = RTM_NEWNEIGH;
-	req.ndm.ndm_family = neighbor->type;
-	req.ndm.ndm_ifindex = dev->index;
-	req.ndm.ndm_type = RTN_UNICAST;
-
-	netlink_add_rtattr_l(&req.n, sizeof(req), NDA_DST,
-			     neighbor->addr, neighbor->addr_len);
-
 	if (hwaddr != NULL && hwaddr->type != PF_UNSPEC) {
-		req.ndm.ndm_state = NUD_REACHABLE;
-
-		netlink_add_rtattr_l(&req.n, sizeof(req), NDA_LLADDR,
-				     hwaddr->addr, hwaddr->addr_len);
-
 		nhrp_debug("NL-ARP(%s) %s is-at %s",
 			   dev->name,
 			   nhrp_address_format(neighbor, sizeof(neigh), neigh),
 			   nhrp_address_format(hwaddr, sizeof(nbma), nbma));
 	} else {
-		req.ndm.ndm_state = NUD_FAILED;
-
 		nhrp_debug("NL-ARP(%s) %s not-reachable",
 			   dev->name,
 			   nhrp_address_format(neighbor, sizeof(neigh), neigh));
 	}
 
-	return netlink_send(&talk_fd, &req.n);
+	netlink_neigh_queue(dev->index, neighbor, hwaddr);
+	return TRUE;
+}
+
+static int netlink_route_update(int add, int oif,
+				struct nhrp_address *dest, int prefix_len,
+				struct nhrp_address *gateway,
+				struct nhrp_address *source, uint16_t mtu)
+{
+	struct {
+		struct nlmsghdr 	n;
+		struct rtmsg 		r;
+		char   			buf[256];
+	} req;
+	struct rtattr *metrics;
+	struct nlmsgerr *err;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (add) {
+		req.n.nlmsg_type = RTM_NEWROUTE;
+		req.n.nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+		req.r.rtm_scope = RT_SCOPE_UNIVERSE;
+		req.r.rtm_type = RTN_UNICAST;
+	} else {
+		req.n.nlmsg_type = RTM_DELROUTE;
+		req.r.rtm_scope = RT_SCOPE_NOWHERE;
+	}
+	req.r.rtm_family = dest->type;
+	req.r.rtm_table = RT_TABLE_MAIN;
+	req.r.rtm_protocol = NHRP_RTPROT;
+	req.r.rtm_dst_len = prefix_len;
+
+	netlink_add_rtattr_l(&req.n, sizeof(req), RTA_DST,
+			     dest->addr, dest->addr_len);
+	if (gateway != NULL && gateway->type != PF_UNSPEC)
+		netlink_add_rtattr_l(&req.n, sizeof(req), RTA_GATEWAY,
+				     gateway->addr, gateway->addr_len);
+	if (source != NULL && source->type != PF_UNSPEC)
+		netlink_add_rtattr_l(&req.n, sizeof(req), RTA_PREFSRC,
+				     source->addr, source->addr_len);
+	if (oif != 0)
+		netlink_add_rtattr_l(&req.n, sizeof(req), RTA_OIF,
+				     &oif, sizeof(int));
+	if (add && mtu != 0) {
+		metrics = NLMSG_TAIL(&req.n);
+		metrics->rta_type = RTA_METRICS;
+		metrics->rta_len = RTA_LENGTH(0);
+		netlink_add_nested_rtattr_u32(metrics, 64, RTAX_MTU, mtu);
+		req.n.nlmsg_len = NLMSG_ALIGN(req.n.nlmsg_len) +
+				  RTA_ALIGN(metrics->rta_len);
+	}
+
+	/* The kernel acknowledges route changes synchronously */
+	if (!netlink_talk(&talk_fd, &req.n, sizeof(req), &req.n))
+		return FALSE;
+	if (req.n.nlmsg_type != NLMSG_ERROR)
+		return TRUE;
+
+	err = NLMSG_DATA(&req.n);
+	if (err->error == 0 || (!add && err->error == -ESRCH))
+		return TRUE;
+
+	errno = -err->error;
+	nhrp_perror(add ? "Cannot add route" : "Cannot delete route");
+	return FALSE;
+}
+
+int kernel_route_update(int add, struct nhrp_interface *dev,
+			struct nhrp_address *dest, int prefix_len,
+			struct nhrp_address *next_hop)
+{
+	char tmp[64];
+
+	nhrp_debug("NL-Route(%s) %s %s/%d",
+		   dev->name, add ? "replace" : "delete",
+		   nhrp_address_format(dest, sizeof(tmp), tmp), prefix_len);
+
+	return netlink_route_update(add, add ? dev->index : 0,
+				    dest, prefix_len,
+				    add ? next_hop : NULL, NULL, 0);
 }
 
+int kernel_nbma_route_update(int add, struct nhrp_address *dest,
+			     struct nhrp_address *source, uint16_t mtu)
+{
+	struct {
+		struct nlmsghdr 	n;
+		struct rtmsg 		r;
+		char   			buf[1024];
+	} req;
+	struct route_cache_entry e, *c;
+	struct nhrp_address *gateway = NULL;
+
+	if (!add)
+		return netlink_route_update(FALSE, 0, dest,
+					    dest->addr_len * 8,
+					    NULL, source, 0);
+
+	/* Pin the current path towards the peer with the given MTU */
+	route_query_key(&e, NULL, dest, source);
+	c = route_cache_lookup(&e.dest, &e.source, e.oif);
+	if (c == NULL) {
+		memset(&req, 0, sizeof(req));
+		route_query_build(&req.n, sizeof(req), &e);
+		if (!netlink_talk(&talk_fd, &req.n, sizeof(req), &req.n) ||
+		    req.n.nlmsg_type != RTM_NEWROUTE) {
+			nhrp_error("No route to peer for MTU route");
+			return FALSE;
+		}
+		route_cache_add(&e, &req.n);
+		c = &e;
+	}
+	if (nhrp_address_cmp(&c->gateway, dest) != 0)
+		gateway = &c->gateway;
+
+	return netlink_route_update(TRUE, c->nh_oif, dest,
+				    dest->addr_len * 8,
+				    gateway, source, mtu);
+}
@@ -13,32 +13,54 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
 #include <linux/types.h>
 #include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/ip.h>
+#include <linux/bpf.h>
 
 #include "libev.h"
 #include "nhrp_defines.h"
 #include "nhrp_common.h"
 #include "nhrp_interface.h"
 #include "nhrp_peer.h"
+#include "sysdep_ring.h"
+
+#define MCAST_PDU_SIZE		1500
+/* Ring space accounted per queued packet */
+#define MCAST_FRAME_SIZE	2048
+/* Packets replicated per idle callback, and messages per sendmmsg() */
+#define MCAST_BATCH_PACKETS	16
+#define MCAST_BATCH_MSGS	1024
 
 struct multicast_packet {
 	struct nhrp_interface *iface;
 	struct sockaddr_ll lladdr;
 	unsigned int pdulen;
-	unsigned char pdu[1500];
+	unsigned char *pdu;
+	struct tpacket3_hdr *frame;
 };
 
 static struct ev_io packet_io;
 static struct ev_timer install_filter_timer;
 static struct ev_idle mcast_route;
+static struct packet_ring packet_ring;
 
-static struct multicast_packet mcast_queue[16];
+/* Queued packets point to the receive ring, or to mcast_buffers
+ * if the ring is not available */
+static struct multicast_packet *mcast_queue;
+static unsigned char *mcast_buffers;
+static int mcast_queue_size;
 static int mcast_head = 0, mcast_tail = 0;
+static struct iovec mcast_iov;
+static ev_tstamp mcast_rate_start;
+static unsigned long mcast_rate_count;
+
+int forward_queue_len = 256;
+struct forward_stats forward_stats;
 
 
 enum {
@@ -107,16 +129,32 @@ static void mark(struct filter *f, int label)
 	f->pos[label] = f->numops;
 }
 
-static int check_interface_multicast(void *ctx, struct nhrp_interface *iface)
+#define FILTER_MULTICAST	0x1	/* Capture outgoing multicast */
+#define FILTER_TRAFFIC		0x2	/* Capture traffic for indications */
+
+static int interface_filter_flags(struct nhrp_interface *iface)
 {
-	struct filter *f = (struct filter *) ctx;
+	int flags = 0;
 
 	if (!(iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED))
 		return 0;
 	if (iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT_DEST)
 		return 0;
 
-	if (iface->mcast_mask || iface->mcast_numaddr)
+	if ((iface->mcast_mask || iface->mcast_numaddr) &&
+	    !(iface->flags & NHRP_INTERFACE_FLAG_MCAST_OFFLOAD))
+		flags |= FILTER_MULTICAST;
+	if (iface->flags & NHRP_INTERFACE_FLAG_REDIRECT)
+		flags |= FILTER_TRAFFIC;
+
+	return flags;
+}
+
+static int check_interface_multicast(void *ctx, struct nhrp_interface *iface)
+{
+	struct filter *f = (struct filter *) ctx;
+
+	if (interface_filter_flags(iface) & FILTER_MULTICAST)
 		emit_jump(f, BPF_JMP|BPF_JEQ|BPF_K, iface->index,
 			  LABEL_ACCEPT_IPv4_MULTICAST, LABEL_NEXT);
 
@@ -147,20 +185,14 @@ static int check_interface_traffic_indication(void *ctx, struct nhrp_interface *
 {
 	struct filter *f = (struct filter *) ctx;
 
-	if (!(iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED))
-		return 0;
-	if (iface->flags & NHRP_INTERFACE_FLAG_SHORTCUT_DEST)
-		return 0;
-	if (!(iface->flags & NHRP_INTERFACE_FLAG_REDIRECT))
-		return 0;
-
-	emit_jump(f, BPF_JMP|BPF_JEQ|BPF_K, iface->index,
-		  LABEL_CHECK_NON_LOCAL_ADDRESS, LABEL_NEXT);
+	if (interface_filter_flags(iface) & FILTER_TRAFFIC)
+		emit_jump(f, BPF_JMP|BPF_JEQ|BPF_K, iface->index,
+			  LABEL_CHECK_NON_LOCAL_ADDRESS, LABEL_NEXT);
 
 	return 0;
 }
 
-static void install_filter_cb(struct ev_timer *w, int revents)
+static void install_classic_filter(void)
 {
 	struct nhrp_peer_selector sel;
 	struct sock_fprog prog;
@@ -241,77 +273,616 @@ static void install_filter_cb(struct ev_timer *w, int revents)
 	free(f.code);
 }
 
-int forward_local_addresses_changed(void)
+/* eBPF version of the above filter. Local prefixes are kept in an
+ * LPM trie map and interface flags in a hash map keyed by ifindex,
+ * so address changes are single map updates and the per packet cost
+ * does not depend on the number of local addresses. */
+
+#define EBPF_MAX_INTERFACES	1024
+#define EBPF_MAX_LOCAL_ADDRS	16384
+#define EBPF_MAX_INSNS		64
+
+enum {
+	EBPF_LABEL_UNICAST = 0,
+	EBPF_LABEL_DROP,
+	EBPF_NUM_LABELS
+};
+
+struct ebpf_prog {
+	struct bpf_insn insn[EBPF_MAX_INSNS];
+	int label[EBPF_MAX_INSNS];
+	int pos[EBPF_NUM_LABELS];
+	int len;
+};
+
+struct ebpf_lpm_key {
+	uint32_t prefixlen;
+	uint8_t addr[4];
+};
+
+/* ebpf_local_map is the set of local prefixes seen by the program.
+ * Lookups in it return the longest match, so the number of local
+ * peers per prefix is kept in the exact match ebpf_refs_map. */
+static int ebpf_iface_map = -1, ebpf_local_map = -1, ebpf_refs_map = -1;
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+#ifdef __NR_bpf
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int ebpf_map_create(int type, int key_size, int value_size,
+			   int max_entries, int flags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+	attr.map_flags = flags;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int ebpf_map_op(int cmd, int fd, void *key, void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t) (unsigned long) key;
+	attr.value = (uint64_t) (unsigned long) value;
+	return sys_bpf(cmd, &attr);
+}
+
+static void ebpf_emit(struct ebpf_prog *p, uint8_t code, int dst, int src,
+		      int16_t off, int32_t imm)
+{
+	struct bpf_insn *insn = &p->insn[p->len];
+
+	NHRP_BUG_ON(p->len >= EBPF_MAX_INSNS);
+	memset(insn, 0, sizeof(*insn));
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+	p->label[p->len] = -1;
+	p->len++;
+}
+
+static void ebpf_jump(struct ebpf_prog *p, uint8_t op, int dst, int32_t imm,
+		      int label)
+{
+	ebpf_emit(p, BPF_JMP|op|BPF_K, dst, 0, 0, imm);
+	p->label[p->len - 1] = label;
+}
+
+static void ebpf_mark(struct ebpf_prog *p, int label)
+{
+	p->pos[label] = p->len;
+}
+
+static void ebpf_lookup(struct ebpf_prog *p, int map_fd, int key_off)
+{
+	/* r0 = bpf_map_lookup_elem(map, fp + key_off) */
+	ebpf_emit(p, BPF_LD|BPF_DW|BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+	ebpf_emit(p, 0, 0, 0, 0, 0);
+	ebpf_emit(p, BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	ebpf_emit(p, BPF_ALU64|BPF_ADD|BPF_K, BPF_REG_2, 0, 0, key_off);
+	ebpf_emit(p, BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+}
+
+static void ebpf_return(struct ebpf_prog *p, int32_t value)
+{
+	ebpf_emit(p, BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_0, 0, 0, value);
+	ebpf_emit(p, BPF_JMP|BPF_EXIT, 0, 0, 0, 0);
+}
+
+static int ebpf_load_program(void)
+{
+	static const char license[] = "Dual MIT/GPL";
+	struct ebpf_prog p;
+	union bpf_attr attr;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+
+	/* r6 = skb, as required by packet loads; check for IPv4 */
+	ebpf_emit(&p, BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	ebpf_emit(&p, BPF_LDX|BPF_MEM|BPF_W, BPF_REG_0, BPF_REG_6,
+		  offsetof(struct __sk_buff, protocol), 0);
+	ebpf_jump(&p, BPF_JNE, BPF_REG_0, htons(ETH_P_IP), EBPF_LABEL_DROP);
+
+	/* r7 = destination address, r8 = packet type */
+	ebpf_emit(&p, BPF_LD|BPF_ABS|BPF_W, 0, 0, 0,
+		  offsetof(struct iphdr, daddr));
+	ebpf_emit(&p, BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_7, BPF_REG_0, 0, 0);
+	ebpf_emit(&p, BPF_LDX|BPF_MEM|BPF_W, BPF_REG_8, BPF_REG_6,
+		  offsetof(struct __sk_buff, pkt_type), 0);
+
+	/* r9 = interface flags, drop if interface not known */
+	ebpf_emit(&p, BPF_LDX|BPF_MEM|BPF_W, BPF_REG_0, BPF_REG_6,
+		  offsetof(struct __sk_buff, ifindex), 0);
+	ebpf_emit(&p, BPF_STX|BPF_MEM|BPF_W, BPF_REG_10, BPF_REG_0, -4, 0);
+	ebpf_lookup(&p, ebpf_iface_map, -4);
+	ebpf_jump(&p, BPF_JEQ, BPF_REG_0, 0, EBPF_LABEL_DROP);
+	ebpf_emit(&p, BPF_LDX|BPF_MEM|BPF_W, BPF_REG_9, BPF_REG_0, 0, 0);
+
+	/* Multicast: outgoing on multicast enabled interface */
+	ebpf_emit(&p, BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_0, BPF_REG_7, 0, 0);
+	ebpf_emit(&p, BPF_ALU64|BPF_RSH|BPF_K, BPF_REG_0, 0, 0, 28);
+	ebpf_jump(&p, BPF_JNE, BPF_REG_0, 0xe, EBPF_LABEL_UNICAST);
+	ebpf_jump(&p, BPF_JNE, BPF_REG_8, PACKET_OUTGOING, EBPF_LABEL_DROP);
+	ebpf_emit(&p, BPF_ALU64|BPF_AND|BPF_K, BPF_REG_9, 0, 0, FILTER_MULTICAST);
+	ebpf_jump(&p, BPF_JEQ, BPF_REG_9, 0, EBPF_LABEL_DROP);
+	ebpf_return(&p, 65535);
+
+	/* Unicast: for us, on interface doing traffic indications,
+	 * and not to a local address */
+	ebpf_mark(&p, EBPF_LABEL_UNICAST);
+	ebpf_jump(&p, BPF_JNE, BPF_REG_8, PACKET_HOST, EBPF_LABEL_DROP);
+	ebpf_emit(&p, BPF_ALU64|BPF_AND|BPF_K, BPF_REG_9, 0, 0, FILTER_TRAFFIC);
+	ebpf_jump(&p, BPF_JEQ, BPF_REG_9, 0, EBPF_LABEL_DROP);
+	ebpf_emit(&p, BPF_ST|BPF_MEM|BPF_W, BPF_REG_10, 0,
+		  -(int) sizeof(struct ebpf_lpm_key), 32);
+	ebpf_emit(&p, BPF_ALU|BPF_END|BPF_TO_BE, BPF_REG_7, 0, 0, 32);
+	ebpf_emit(&p, BPF_STX|BPF_MEM|BPF_W, BPF_REG_10, BPF_REG_7,
+		  (int) offsetof(struct ebpf_lpm_key, addr) -
+		  (int) sizeof(struct ebpf_lpm_key), 0);
+	ebpf_lookup(&p, ebpf_local_map, -(int) sizeof(struct ebpf_lpm_key));
+	ebpf_jump(&p, BPF_JNE, BPF_REG_0, 0, EBPF_LABEL_DROP);
+	/* Return the header for Traffic Indication packet */
+	ebpf_return(&p, 68);
+
+	ebpf_mark(&p, EBPF_LABEL_DROP);
+	ebpf_return(&p, 0);
+
+	/* Fixup jumps to be relative */
+	for (i = 0; i < p.len; i++) {
+		if (p.label[i] >= 0)
+			p.insn[i].off = p.pos[p.label[i]] - i - 1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insn_cnt = p.len;
+	attr.insns = (uint64_t) (unsigned long) p.insn;
+	attr.license = (uint64_t) (unsigned long) license;
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static void ebpf_local_address_update(struct nhrp_peer *peer, int delta)
+{
+	struct nhrp_address prefix = peer->protocol_address;
+	struct ebpf_lpm_key key;
+	uint32_t refs = 0;
+
+	nhrp_address_set_network(&prefix, peer->prefix_length);
+	memset(&key, 0, sizeof(key));
+	key.prefixlen = peer->prefix_length;
+	memcpy(key.addr, prefix.addr, sizeof(key.addr));
+
+	/* Several local peers can map to the same prefix */
+	if (ebpf_map_op(BPF_MAP_LOOKUP_ELEM, ebpf_refs_map,
+			&key, &refs) < 0) {
+		if (delta < 0)
+			return;
+		refs = 0;
+	}
+	refs += delta;
+	if (refs == 0) {
+		ebpf_map_op(BPF_MAP_DELETE_ELEM, ebpf_refs_map, &key, NULL);
+		ebpf_map_op(BPF_MAP_DELETE_ELEM, ebpf_local_map, &key, NULL);
+		return;
+	}
+
+	if (ebpf_map_op(BPF_MAP_UPDATE_ELEM, ebpf_refs_map,
+			&key, &refs) < 0 ||
+	    (refs == 1 &&
+	     ebpf_map_op(BPF_MAP_UPDATE_ELEM, ebpf_local_map,
+			 &key, &refs) < 0))
+		nhrp_perror("Failed to update local address filter");
+}
+
+static int ebpf_sync_interface(void *ctx, struct nhrp_interface *iface)
 {
+	uint32_t key = iface->index, flags;
+
+	if (key == 0)
+		return 0;
+
+	flags = interface_filter_flags(iface);
+	if (flags != 0)
+		ebpf_map_op(BPF_MAP_UPDATE_ELEM, ebpf_iface_map, &key, &flags);
+	else
+		ebpf_map_op(BPF_MAP_DELETE_ELEM, ebpf_iface_map, &key, NULL);
+
+	return 0;
+}
+
+static void ebpf_sync_interfaces(void)
+{
+	uint32_t key, next, stale[EBPF_MAX_INTERFACES];
+	int i, num_stale = 0;
+
+	nhrp_interface_foreach(ebpf_sync_interface, NULL);
+
+	/* Remove interfaces that have disappeared */
+	if (ebpf_map_op(BPF_MAP_GET_NEXT_KEY, ebpf_iface_map, NULL, &next) < 0)
+		return;
+	do {
+		if (nhrp_interface_get_by_index(next, FALSE) == NULL)
+			stale[num_stale++] = next;
+		key = next;
+	} while (num_stale < EBPF_MAX_INTERFACES &&
+		 ebpf_map_op(BPF_MAP_GET_NEXT_KEY, ebpf_iface_map,
+			     &key, &next) == 0);
+
+	for (i = 0; i < num_stale; i++)
+		ebpf_map_op(BPF_MAP_DELETE_ELEM, ebpf_iface_map,
+			    &stale[i], NULL);
+}
+
+static int ebpf_add_local_address(void *ctx, struct nhrp_peer *peer)
+{
+	forward_local_address_add(peer);
+	return 0;
+}
+
+static int install_ebpf_filter(void)
+{
+	struct nhrp_peer_selector sel;
+	int prog;
+
+	ebpf_iface_map = ebpf_map_create(BPF_MAP_TYPE_HASH, sizeof(uint32_t),
+					 sizeof(uint32_t),
+					 EBPF_MAX_INTERFACES, 0);
+	ebpf_local_map = ebpf_map_create(BPF_MAP_TYPE_LPM_TRIE,
+					 sizeof(struct ebpf_lpm_key),
+					 sizeof(uint32_t),
+					 EBPF_MAX_LOCAL_ADDRS,
+					 BPF_F_NO_PREALLOC);
+	ebpf_refs_map = ebpf_map_create(BPF_MAP_TYPE_HASH,
+					sizeof(struct ebpf_lpm_key),
+					sizeof(uint32_t),
+					EBPF_MAX_LOCAL_ADDRS, 0);
+	if (ebpf_iface_map < 0 || ebpf_local_map < 0 || ebpf_refs_map < 0)
+		goto err;
+
+	prog = ebpf_load_program();
+	if (prog < 0)
+		goto err;
+
+	if (setsockopt(packet_io.fd, SOL_SOCKET, SO_ATTACH_BPF,
+		       &prog, sizeof(prog)) < 0) {
+		close(prog);
+		goto err;
+	}
+	close(prog);
+
+	ebpf_sync_interfaces();
+	memset(&sel, 0, sizeof(sel));
+	sel.type_mask = BIT(NHRP_PEER_TYPE_LOCAL_ADDR);
+	sel.flags = NHRP_PEER_FIND_UP;
+	nhrp_peer_foreach(ebpf_add_local_address, NULL, &sel);
+
+	nhrp_info("eBPF filter installed");
+	return TRUE;
+
+err:
+	nhrp_debug("eBPF filter not available: %s", strerror(errno));
+	if (ebpf_iface_map >= 0)
+		close(ebpf_iface_map);
+	if (ebpf_local_map >= 0)
+		close(ebpf_local_map);
+	if (ebpf_refs_map >= 0)
+		close(ebpf_refs_map);
+	ebpf_iface_map = ebpf_local_map = ebpf_refs_map = -1;
+	return FALSE;
+}
+
+static void install_filter_cb(struct ev_timer *w, int revents)
+{
+	if (ebpf_local_map >= 0)
+		ebpf_sync_interfaces();
+	else
+		install_classic_filter();
+}
+
+void forward_local_address_add(struct nhrp_peer *peer)
+{
+	if (ebpf_local_map >= 0 && peer->protocol_type == ETHPROTO_IP &&
+	    !(peer->flags & NHRP_PEER_FLAG_FILTERED)) {
+		ebpf_local_address_update(peer, 1);
+		peer->flags |= NHRP_PEER_FLAG_FILTERED;
+	}
+
 	if (install_filter_timer.cb != NULL)
 		ev_timer_start(&install_filter_timer);
-	return TRUE;
 }
 
-static void send_multicast(struct ev_idle *w, int revents)
+void forward_local_address_del(struct nhrp_peer *peer)
+{
+	if (ebpf_local_map >= 0 && (peer->flags & NHRP_PEER_FLAG_FILTERED)) {
+		ebpf_local_address_update(peer, -1);
+		peer->flags &= ~NHRP_PEER_FLAG_FILTERED;
+	}
+
+	if (install_filter_timer.cb != NULL)
+		ev_timer_start(&install_filter_timer);
+}
+
+static void mcast_queue_pop(void)
+{
+	struct multicast_packet *pkt = &mcast_queue[mcast_tail];
+
+	if (pkt->frame != NULL) {
+		packet_ring_unhold(&packet_ring, pkt->frame);
+		pkt->frame = NULL;
+	}
+	mcast_tail = (mcast_tail + 1) % mcast_queue_size;
+}
+
+static void mcast_queue_push(struct nhrp_interface *iface,
+			     struct sockaddr_ll *lladdr,
+			     uint8_t *pdu, unsigned int pdulen,
+			     struct tpacket3_hdr *frame)
 {
 	struct multicast_packet *pkt;
+
+	/* Drop the oldest packet, if we haven't processed it yet. */
+	if ((mcast_head + 1) % mcast_queue_size == mcast_tail) {
+		mcast_queue_pop();
+		forward_stats.mcast_queue_drops++;
+	}
+
+	pkt = &mcast_queue[mcast_head];
+	pkt->iface = iface;
+	pkt->lladdr = *lladdr;
+	pkt->pdu = pdu;
+	pkt->pdulen = pdulen;
+	pkt->frame = frame;
+	if (frame != NULL)
+		packet_ring_hold(&packet_ring, frame);
+	mcast_head = (mcast_head + 1) % mcast_queue_size;
+	forward_stats.mcast_queued++;
+
+	ev_idle_start(&mcast_route);
+}
+
+static int mcast_build_dests(struct nhrp_interface *iface)
+{
 	struct nhrp_peer *peer;
-	struct iovec iov;
-	struct msghdr msg;
+	struct sockaddr_ll *lladdr;
+	int n = 0;
+
+	list_for_each_entry(peer, &iface->mcast_list, mcast_list_entry)
+		n++;
+
+	if (n > iface->mcast_dests_alloc) {
+		free(iface->mcast_msgs);
+		free(iface->mcast_dests);
+		iface->mcast_msgs = calloc(n, sizeof(struct mmsghdr));
+		iface->mcast_dests = calloc(n, sizeof(struct sockaddr_ll));
+		if (iface->mcast_msgs == NULL || iface->mcast_dests == NULL) {
+			free(iface->mcast_msgs);
+			free(iface->mcast_dests);
+			iface->mcast_msgs = NULL;
+			iface->mcast_dests = NULL;
+			iface->mcast_dests_alloc = 0;
+			iface->mcast_num_dests = 0;
+			return FALSE;
+		}
+		iface->mcast_dests_alloc = n;
+	}
 
-	if (mcast_head == mcast_tail) {
-		ev_idle_stop(&mcast_route);
-		return;
+	n = 0;
+	list_for_each_entry(peer, &iface->mcast_list, mcast_list_entry) {
+		lladdr = &iface->mcast_dests[n];
+		memset(lladdr, 0, sizeof(*lladdr));
+		lladdr->sll_family = AF_PACKET;
+		lladdr->sll_ifindex = iface->index;
+		lladdr->sll_halen = peer->next_hop_address.addr_len;
+		memcpy(lladdr->sll_addr, peer->next_hop_address.addr,
+		       lladdr->sll_halen);
+
+		iface->mcast_msgs[n].msg_hdr = (struct msghdr) {
+			.msg_name = lladdr,
+			.msg_namelen = sizeof(*lladdr),
+			.msg_iov = &mcast_iov,
+			.msg_iovlen = 1,
+		};
+		n++;
 	}
+	iface->mcast_num_dests = n;
+	iface->mcast_dests_generation = iface->mcast_generation;
 
-	/* Pop a packet */
-	pkt = &mcast_queue[mcast_tail];
-	mcast_tail = (mcast_tail + 1) % ARRAY_SIZE(mcast_queue);
+	return TRUE;
+}
 
-	/* And softroute it forward */
-	iov.iov_base = pkt->pdu;
-	iov.iov_len = pkt->pdulen;
-	msg = (struct msghdr) {
-		.msg_name = &pkt->lladdr,
-		.msg_namelen = sizeof(pkt->lladdr),
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-	};
+static void mcast_replicate(struct multicast_packet *pkt)
+{
+	struct nhrp_interface *iface = pkt->iface;
+	int i, r, n;
 
-	list_for_each_entry(peer, &pkt->iface->mcast_list, mcast_list_entry) {
-		/* Update NBMA destination */
-		pkt->lladdr.sll_halen = peer->next_hop_address.addr_len;
-		memcpy(pkt->lladdr.sll_addr, peer->next_hop_address.addr,
-		       pkt->lladdr.sll_halen);
+	if (iface->mcast_dests == NULL ||
+	    iface->mcast_dests_generation != iface->mcast_generation) {
+		if (!mcast_build_dests(iface))
+			return;
+	}
 
-		/* Best effort attempt to emulate multicast */
-		(void) sendmsg(packet_io.fd, &msg, 0);
+	/* All messages share the payload iovec */
+	mcast_iov.iov_base = pkt->pdu;
+	mcast_iov.iov_len = pkt->pdulen;
+	if (iface->mcast_num_dests != 0 &&
+	    iface->mcast_dests[0].sll_protocol != pkt->lladdr.sll_protocol) {
+		for (i = 0; i < iface->mcast_num_dests; i++)
+			iface->mcast_dests[i].sll_protocol =
+				pkt->lladdr.sll_protocol;
+	}
+
+	/* Best effort attempt to emulate multicast */
+	for (i = 0; i < iface->mcast_num_dests; ) {
+		n = iface->mcast_num_dests - i;
+		if (n > MCAST_BATCH_MSGS)
+			n = MCAST_BATCH_MSGS;
+
+		r = sendmmsg(packet_io.fd, &iface->mcast_msgs[i], n, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			/* First message of the batch failed; skip it */
+			iface->mcast_tx_errors++;
+			i++;
+			continue;
+		}
+
+		iface->mcast_tx_packets += r;
+		forward_stats.mcast_replicated += r;
+		mcast_rate_count += r;
+		i += r;
 	}
 }
 
-static void pfp_read_cb(struct ev_io *w, int revents)
+static void mcast_update_rate(void)
+{
+	if (ev_now() < mcast_rate_start + 1.0)
+		return;
+
+	forward_stats.mcast_rate = mcast_rate_count /
+		(ev_now() - mcast_rate_start);
+	mcast_rate_start = ev_now();
+	mcast_rate_count = 0;
+}
+
+static void send_multicast(struct ev_idle *w, int revents)
+{
+	int i;
+
+	mcast_update_rate();
+	for (i = 0; i < MCAST_BATCH_PACKETS; i++) {
+		if (mcast_head == mcast_tail) {
+			ev_idle_stop(&mcast_route);
+			break;
+		}
+
+		/* Softroute the oldest packet forward */
+		mcast_replicate(&mcast_queue[mcast_tail]);
+		mcast_queue_pop();
+	}
+
+	ev_io_start(&packet_io);
+}
+
+static void pfp_process(struct sockaddr_ll *lladdr, uint8_t *pdu, int len,
+			struct tpacket3_hdr *frame)
 {
 	struct nhrp_address nbma_src, src, dst;
 	struct nhrp_interface *iface;
-	struct sockaddr_ll *lladdr;
+	char fr[32], to[32];
+
+	if (lladdr->sll_pkttype != PACKET_OUTGOING &&
+	    lladdr->sll_pkttype != PACKET_HOST)
+		return;
+
+	iface = nhrp_interface_get_by_index(lladdr->sll_ifindex, FALSE);
+	if (iface == NULL)
+		return;
+	if (!(iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED))
+		return;
+
+	if (!nhrp_address_parse_packet(lladdr->sll_protocol,
+				       len, pdu, &src, &dst))
+		return;
+
+	if (nhrp_address_is_multicast(&dst)) {
+		if (lladdr->sll_pkttype != PACKET_OUTGOING)
+			return;
+
+		nhrp_debug("Multicast from %s to %s",
+			   nhrp_address_format(&src, sizeof(fr), fr),
+			   nhrp_address_format(&dst, sizeof(to), to));
+
+		/* Queue packet for processing later (handle important
+		 * stuff first) */
+		mcast_queue_push(iface, lladdr, pdu, len, frame);
+	} else {
+		if (lladdr->sll_pkttype != PACKET_HOST)
+			return;
+
+		nhrp_address_set(&nbma_src, PF_INET,
+				 lladdr->sll_halen,
+				 lladdr->sll_addr);
+		nhrp_packet_send_traffic(iface,
+					 &nbma_src, &src, &dst,
+					 lladdr->sll_protocol,
+					 pdu, len);
+	}
+}
+
+static void pfp_ring_read_cb(struct ev_io *w, int revents)
+{
+	struct tpacket3_hdr *hdr;
+
+	if (!(revents & EV_READ))
+		return;
+
+	while (TRUE) {
+		hdr = packet_ring_next(&packet_ring);
+		if (hdr == NULL) {
+			/* Blocks held by queued packets keep the socket
+			 * readable; pause until the queue is serviced. */
+			if (!packet_ring_blocked(&packet_ring)) {
+				if (mcast_head != mcast_tail)
+					ev_io_stop(&packet_io);
+				return;
+			}
+
+			/* Whole ring is queued multicast; make room by
+			 * dropping the oldest packets. */
+			NHRP_BUG_ON(mcast_head == mcast_tail);
+			mcast_queue_pop();
+			forward_stats.mcast_queue_drops++;
+			continue;
+		}
+
+		pfp_process(packet_ring_lladdr(hdr),
+			    (uint8_t *) hdr + hdr->tp_net,
+			    hdr->tp_snaplen, hdr);
+	}
+}
+
+static void pfp_read_cb(struct ev_io *w, int revents)
+{
+	struct sockaddr_ll lladdr;
 	struct iovec iov;
 	struct msghdr msg = {
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 	};
-	char fr[32], to[32];
+	uint8_t *pdu;
 	int r, fd = w->fd;
 
 	if (!(revents & EV_READ))
 		return;
 
 	while (TRUE) {
-		/* Get a scracth buffer directly from mcast queue, so we do
-		 * not need copy the data later. */
-		msg.msg_name = &mcast_queue[mcast_head].lladdr;
-		msg.msg_namelen = sizeof(mcast_queue[mcast_head].lladdr);
-		iov.iov_base = mcast_queue[mcast_head].pdu;
-		iov.iov_len = sizeof(mcast_queue[mcast_head].pdu);
+		/* Receive directly to the free slot at queue head, so
+		 * we do not need copy the data later. */
+		pdu = &mcast_buffers[mcast_head * MCAST_PDU_SIZE];
+		msg.msg_name = &lladdr;
+		msg.msg_namelen = sizeof(lladdr);
+		iov.iov_base = pdu;
+		iov.iov_len = MCAST_PDU_SIZE;
 
 		/* Receive */
 		r = recvmsg(fd, &msg, MSG_DONTWAIT);
-		mcast_queue[mcast_head].pdulen = r;
 
 		/* Process */
 		if (r < 0) {
@@ -328,60 +899,21 @@ static void pfp_read_cb(struct ev_io *w, int revents)
 			return;
 		}
 
-		lladdr = &mcast_queue[mcast_head].lladdr;
-		if (lladdr->sll_pkttype != PACKET_OUTGOING &&
-		    lladdr->sll_pkttype != PACKET_HOST)
-			continue;
-
-		iface = nhrp_interface_get_by_index(lladdr->sll_ifindex, FALSE);
-		if (iface == NULL)
-			continue;
-		if (!(iface->flags & NHRP_INTERFACE_FLAG_CONFIGURED))
-			continue;
-
-		if (!nhrp_address_parse_packet(lladdr->sll_protocol,
-					       r, iov.iov_base,
-					       &src, &dst))
-			return;
-
-		if (nhrp_address_is_multicast(&dst)) {
-			if (lladdr->sll_pkttype != PACKET_OUTGOING)
-				continue;
-
-			nhrp_debug("Multicast from %s to %s",
-				   nhrp_address_format(&src, sizeof(fr), fr),
-				   nhrp_address_format(&dst, sizeof(to), to));
-
-			/* Queue packet for processing later (handle important
-			 * stuff first) */
-			mcast_queue[mcast_head].iface = iface;
-			mcast_head = (mcast_head + 1) % ARRAY_SIZE(mcast_queue);
-
-			/* Drop packets from queue tail, if we haven't processed
-			 * them yet. */
-			if (mcast_head == mcast_tail)
-				mcast_tail = (mcast_tail + 1) %
-					ARRAY_SIZE(mcast_queue);
-
-			ev_idle_start(&mcast_route);
-		} else {
-			if (lladdr->sll_pkttype != PACKET_HOST)
-				continue;
-
-			nhrp_address_set(&nbma_src, PF_INET,
-					 lladdr->sll_halen,
-					 lladdr->sll_addr);
-			nhrp_packet_send_traffic(iface,
-						 &nbma_src, &src, &dst,
-						 lladdr->sll_protocol,
-						 iov.iov_base, r);
-		}
+		pfp_process(&lladdr, pdu, r, NULL);
 	}
 }
 
+void forward_update_stats(void)
+{
+	mcast_update_rate();
+	if (packet_io.fd > 0)
+		forward_stats.mcast_kernel_drops +=
+			packet_socket_drops(packet_io.fd);
+}
+
 int forward_init(void)
 {
-	int fd;
+	int fd, blocks;
 
 	fd = socket(PF_PACKET, SOCK_DGRAM, ntohs(ETH_P_ALL));
 	if (fd < 0) {
@@ -391,22 +923,56 @@ int forward_init(void)
 
 	fcntl(fd, F_SETFD, FD_CLOEXEC);
 
-	ev_io_init(&packet_io, pfp_read_cb, fd, EV_READ);
+	mcast_queue_size = forward_queue_len + 1;
+	mcast_queue = calloc(mcast_queue_size, sizeof(struct multicast_packet));
+	if (mcast_queue == NULL)
+		goto err_close;
+
+	blocks = forward_queue_len * MCAST_FRAME_SIZE / PACKET_RING_BLOCK_SIZE + 2;
+	if (packet_ring_open(&packet_ring, fd, blocks)) {
+		nhrp_debug("Multicast receive ring with %d blocks", blocks);
+		ev_io_init(&packet_io, pfp_ring_read_cb, fd, EV_READ);
+	} else {
+		mcast_buffers = malloc(mcast_queue_size * MCAST_PDU_SIZE);
+		if (mcast_buffers == NULL)
+			goto err_close;
+		ev_io_init(&packet_io, pfp_read_cb, fd, EV_READ);
+	}
 	ev_io_start(&packet_io);
 
 	ev_timer_init(&install_filter_timer, install_filter_cb, .01, .0);
-	install_filter_cb(&install_filter_timer, 0);
+	if (!install_ebpf_filter())
+		install_classic_filter();
 
 	ev_idle_init(&mcast_route, send_multicast);
 	ev_set_priority(&mcast_route, -1);
 
 	return TRUE;
+
+err_close:
+	nhrp_error("Unable to allocate multicast queue");
+	free(mcast_queue);
+	mcast_queue = NULL;
+	close(fd);
+	return FALSE;
 }
 
 void forward_cleanup(void)
 {
 	ev_io_stop(&packet_io);
+	while (mcast_head != mcast_tail)
+		mcast_queue_pop();
+	packet_ring_close(&packet_ring, packet_io.fd);
 	close(packet_io.fd);
 	ev_timer_stop(&install_filter_timer);
 	ev_idle_stop(&mcast_route);
+	free(mcast_queue);
+	free(mcast_buffers);
+	if (ebpf_iface_map >= 0)
+		close(ebpf_iface_map);
+	if (ebpf_local_map >= 0)
+		close(ebpf_local_map);
+	if (ebpf_refs_map >= 0)
+		close(ebpf_refs_map);
+	ebpf_iface_map = ebpf_local_map = ebpf_refs_map = -1;
 }
@@ -0,0 +1,166 @@
+/* sysdep_ring.c - PF_PACKET memory mapped receive ring
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "nhrp_defines.h"
+#include "sysdep_ring.h"
+
+/* TPACKET_V3 hands whole blocks of frames to user space. A block
+ * is given back to the kernel once all its frames have been
+ * consumed, so a frame returned by packet_ring_next() stays valid
+ * until the next call. Frames needed for longer are held; their
+ * block is given back when the last hold is dropped. */
+
+#define PACKET_RING_FRAME_SIZE		2048
+#define PACKET_RING_RETIRE_MSEC		5
+
+int packet_ring_open(struct packet_ring *ring, int fd, int num_blocks)
+{
+	struct tpacket_req3 req;
+	int ver = TPACKET_V3;
+
+	memset(ring, 0, sizeof(*ring));
+	if (num_blocks <= 0)
+		return FALSE;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+		return FALSE;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PACKET_RING_BLOCK_SIZE;
+	req.tp_block_nr = num_blocks;
+	req.tp_frame_size = PACKET_RING_FRAME_SIZE;
+	req.tp_frame_nr = num_blocks *
+		(PACKET_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE);
+	req.tp_retire_blk_tov = PACKET_RING_RETIRE_MSEC;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+		goto err_version;
+
+	ring->map_size = (size_t) num_blocks * PACKET_RING_BLOCK_SIZE;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		goto err_ring;
+	}
+	ring->holds = calloc(num_blocks, sizeof(ring->holds[0]));
+	if (ring->holds == NULL)
+		goto err_unmap;
+	ring->num_blocks = num_blocks;
+
+	return TRUE;
+
+err_unmap:
+	munmap(ring->map, ring->map_size);
+	memset(ring, 0, sizeof(*ring));
+err_ring:
+	memset(&req, 0, sizeof(req));
+	setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+err_version:
+	ver = TPACKET_V1;
+	setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver));
+	return FALSE;
+}
+
+void packet_ring_close(struct packet_ring *ring, int fd)
+{
+	struct tpacket_req3 req;
+
+	if (ring->map == NULL)
+		return;
+
+	munmap(ring->map, ring->map_size);
+	free(ring->holds);
+	memset(&req, 0, sizeof(req));
+	setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+	memset(ring, 0, sizeof(*ring));
+}
+
+static struct tpacket_block_desc *packet_ring_block(struct packet_ring *ring,
+						    unsigned int block)
+{
+	return (struct tpacket_block_desc *)
+		(ring->map + block * PACKET_RING_BLOCK_SIZE);
+}
+
+static void packet_ring_give_back(struct packet_ring *ring,
+				  unsigned int block)
+{
+	__sync_synchronize();
+	packet_ring_block(ring, block)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+}
+
+struct tpacket3_hdr *packet_ring_next(struct packet_ring *ring)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *hdr;
+
+	while (1) {
+		bd = packet_ring_block(ring, ring->current);
+
+		if (ring->frame == NULL) {
+			if (ring->holds[ring->current] != 0)
+				return NULL;
+			if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+				return NULL;
+			__sync_synchronize();
+			ring->frame = (uint8_t *) bd +
+				bd->hdr.bh1.offset_to_first_pkt;
+			ring->frames_left = bd->hdr.bh1.num_pkts;
+		}
+
+		if (ring->frames_left > 0) {
+			hdr = (struct tpacket3_hdr *) ring->frame;
+			ring->frame += hdr->tp_next_offset;
+			ring->frames_left--;
+			return hdr;
+		}
+
+		/* Block consumed, give it back to kernel */
+		if (ring->holds[ring->current] == 0)
+			packet_ring_give_back(ring, ring->current);
+		ring->frame = NULL;
+		ring->current = (ring->current + 1) % ring->num_blocks;
+	}
+}
+
+void packet_ring_hold(struct packet_ring *ring, struct tpacket3_hdr *hdr)
+{
+	ring->holds[((uint8_t *) hdr - ring->map) / PACKET_RING_BLOCK_SIZE]++;
+}
+
+void packet_ring_unhold(struct packet_ring *ring, struct tpacket3_hdr *hdr)
+{
+	unsigned int block = ((uint8_t *) hdr - ring->map) / PACKET_RING_BLOCK_SIZE;
+
+	if (--ring->holds[block] != 0)
+		return;
+
+	/* Block still being read is given back by packet_ring_next() */
+	if (block == ring->current && ring->frame != NULL)
+		return;
+
+	packet_ring_give_back(ring, block);
+}
+
+unsigned int packet_socket_drops(int fd)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	/* Reading the statistics resets them */
+	memset(&st, 0, sizeof(st));
+	if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+		return 0;
+
+	return st.tp_drops;
+}
@@ -0,0 +1,52 @@
+/* sysdep_ring.h - PF_PACKET memory mapped receive ring
+ *
+ * Copyright (c) 2007-2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This software is licensed under the MIT License.
+ * See MIT-LICENSE.txt for additional details.
+ */
+
+#ifndef SYSDEP_RING_H
+#define SYSDEP_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/if_packet.h>
+
+#define PACKET_RING_BLOCK_SIZE		(64 * 1024)
+
+struct packet_ring {
+	uint8_t *map;
+	size_t map_size;
+	unsigned int num_blocks;
+	unsigned int current;
+	uint8_t *frame;
+	unsigned int frames_left;
+	unsigned short *holds;
+};
+
+int packet_ring_open(struct packet_ring *ring, int fd, int num_blocks);
+void packet_ring_close(struct packet_ring *ring, int fd);
+struct tpacket3_hdr *packet_ring_next(struct packet_ring *ring);
+void packet_ring_hold(struct packet_ring *ring, struct tpacket3_hdr *hdr);
+void packet_ring_unhold(struct packet_ring *ring, struct tpacket3_hdr *hdr);
+unsigned int packet_socket_drops(int fd);
+
+static inline int packet_ring_active(struct packet_ring *ring)
+{
+	return ring->map != NULL;
+}
+
+/* Reader has wrapped around to a block that is still held */
+static inline int packet_ring_blocked(struct packet_ring *ring)
+{
+	return ring->frame == NULL && ring->holds[ring->current] != 0;
+}
+
+static inline struct sockaddr_ll *packet_ring_lladdr(struct tpacket3_hdr *hdr)
+{
+	return (struct sockaddr_ll *)
+		((uint8_t *) hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+}
+
+#endif